@@ -0,0 +1,193 @@
+#define _CRT_SECURE_NO_WARNINGS (1)
+#define _GNU_SOURCE // perf_counters.h needs syscall(), requested before any system header
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+#define ARENA_IMPLEMENTATION
+#define ARENA_BACKEND_MALLOC
+#include "arena.h"
+#include <stdint.h>
+#include <errno.h>
+#define BITWRITER_IMPLEMENTATION
+#include "bit_writer.h"
+#define BITREADER_IMPLEMENTATION
+#include "bit_reader.h"
+#define HUFFMAN_IMPLEMENTATION
+#include "huffman.h"
+#define PERF_COUNTERS_IMPLEMENTATION
+#include "perf_counters.h"
+
+typedef enum {
+    BENCH_PHASE_COMPRESS,
+    BENCH_PHASE_DECOMPRESS,
+    BENCH_PHASE_COUNT,
+} BenchPhase;
+
+const char* bench_phase_names[BENCH_PHASE_COUNT] = {"comp", "decomp"};
+
+char* readfile(Arena* arena, char* path, size_t* len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    fseek(f, 0, SEEK_END);
+    size_t fsize = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *string = arena_alloc_ex(arena, fsize+1, ARENA_FLAG_ASAN_SEPARATION, 1, 1);
+    fread(string, fsize, 1, f);
+    fclose(f);
+    string[fsize] = 0;
+    *len = fsize;
+    return string;
+}
+
+double now_seconds(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Moves the counts of one phase run into the per level totals
+void take_counters(PerfCounters* phase_counters, PerfCounters* total) {
+    for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+        total->available[i] = phase_counters->available[i];
+        total->values[i] += phase_counters->values[i];
+    }
+    perf_counters_clear(phase_counters);
+}
+
+void print_counter(PerfCounters* counters, PerfCounterKind kind, double divisor) {
+    if (counters->available[kind] && divisor > 0) {
+        printf(" %11.3f", (double)counters->values[kind] / divisor);
+    }
+    else {
+        printf(" %11s", "n/a");
+    }
+}
+
+int main(int argc, char** argv) {
+    bool use_counters = false;
+    size_t thread_count = 1;
+    while (argc > 2 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "--counters") == 0) {
+            use_counters = true;
+        }
+        else if (strcmp(argv[1], "--threads") == 0) {
+            thread_count = strtoul(argv[2], 0, 10);
+            argv += 1;
+            argc -= 1;
+        }
+        else {
+            break;
+        }
+        argv += 1;
+        argc -= 1;
+    }
+    if (argc != 2 && argc != 3) {
+        printf("Usage: bench [--counters] [--threads n] <infile> [iterations]\n");
+        return -1;
+    }
+    size_t iterations = argc == 3 ? strtoul(argv[2], 0, 10) : 3;
+    if (iterations == 0) iterations = 1;
+    Arena arena = arena_init(1000000000);
+    size_t msg_len = 0;
+    char* msg = readfile(&arena, argv[1], &msg_len);
+    if (!msg) {
+        perror("File read failed");
+        return -1;
+    }
+    size_t capacity = huffman_compress_bound(msg_len);
+    unsigned char* compressed = arena_alloc_ex(&arena, capacity, 0, 1, 1);
+    char* decoded = arena_alloc_ex(&arena, msg_len+1, 0, 1, 1);
+    HuffmanDecoder decoder = {0};
+    // Parallel decoding decodes into scratch before copying into place
+    if (!huffman_decoder_init(&decoder, thread_count > 1 ? 1<<24 : 1<<20)) {
+        printf("Failed to create decoder\n");
+        return -1;
+    }
+    huffman_decoder_set_threads(&decoder, thread_count);
+    PerfCounters counters[HUFFMAN_LEVEL_MAX+1][BENCH_PHASE_COUNT] = {0};
+    PerfCounters phase_counters = {0};
+    double compress_speeds[HUFFMAN_LEVEL_MAX+1] = {0};
+    if (use_counters && !perf_counters_open(&phase_counters)) {
+        printf("Hardware counters unavailable, reporting timings only\n");
+        use_counters = false;
+    }
+
+    printf("kernels: %s\n", huffman_kernels_name());
+    printf("%-6s %12s %8s %12s %12s\n", "level", "size", "ratio", "comp MB/s", "decomp MB/s");
+    for (int level = HUFFMAN_LEVEL_FASTEST; level <= HUFFMAN_LEVEL_MAX; level++) {
+        HuffmanEncoder encoder = {0};
+        if (!huffman_encoder_init(&encoder, 1<<26, level)) {
+            printf("Failed to create encoder\n");
+            return -1;
+        }
+        // The fastest iteration, the others lost time to whatever else ran
+        double compress_time = 0;
+        double decompress_time = 0;
+        size_t compressed_len = 0;
+        for (size_t it = 0; it < iterations; it++) {
+            if (use_counters) perf_counters_start(&phase_counters);
+            double start = now_seconds();
+            if (!huffman_encoder_compress(&encoder, msg, msg_len, compressed, capacity, &compressed_len)) {
+                printf("Level %d: failed to encode message\n", level);
+                return -1;
+            }
+            double elapsed = now_seconds() - start;
+            if (it == 0 || elapsed < compress_time) compress_time = elapsed;
+            if (use_counters) perf_counters_stop(&phase_counters);
+            huffman_encoder_reset(&encoder);
+
+            size_t decoded_len = 0;
+            if (use_counters) {
+                take_counters(&phase_counters, &counters[level][BENCH_PHASE_COMPRESS]);
+                perf_counters_start(&phase_counters);
+            }
+            start = now_seconds();
+            bool ok = huffman_decoder_decompress(&decoder, compressed, compressed_len, decoded, msg_len, &decoded_len);
+            elapsed = now_seconds() - start;
+            if (it == 0 || elapsed < decompress_time) decompress_time = elapsed;
+            if (use_counters) {
+                perf_counters_stop(&phase_counters);
+                take_counters(&phase_counters, &counters[level][BENCH_PHASE_DECOMPRESS]);
+            }
+            if (!ok || decoded_len != msg_len || memcmp(decoded, msg, msg_len) != 0) {
+                printf("Level %d: roundtrip mismatch\n", level);
+                return -1;
+            }
+        }
+        huffman_encoder_deinit(&encoder);
+        double mb = (double)msg_len / 1e6;
+        compress_speeds[level] = mb / compress_time;
+        printf(
+            "%-6d %12zu %8.3f %12.2f %12.2f\n",
+            level,
+            compressed_len,
+            msg_len ? (double)compressed_len / msg_len : 0.0,
+            compress_speeds[level],
+            mb / decompress_time
+        );
+    }
+    // The fast levels only earn their ratio by being faster than the default
+    double speedup = compress_speeds[HUFFMAN_LEVEL_FASTEST] / compress_speeds[HUFFMAN_LEVEL_DEFAULT];
+    printf("\nlevel %d compresses %.2fx as fast as level %d%s\n", HUFFMAN_LEVEL_FASTEST, speedup, HUFFMAN_LEVEL_DEFAULT, speedup > 1 ? "" : ", not faster");
+    if (use_counters) {
+        printf("\n%-6s %-7s %11s %11s %11s %11s %11s\n", "level", "phase", "cycles/B", "IPC", "brmiss/KB", "L1Dmiss/KB", "LLCmiss/KB");
+        for (int level = HUFFMAN_LEVEL_FASTEST; level <= HUFFMAN_LEVEL_MAX; level++) {
+            for (size_t phase = 0; phase < BENCH_PHASE_COUNT; phase++) {
+                PerfCounters* c = &counters[level][phase];
+                double bytes = (double)msg_len * iterations;
+                double cycles = c->available[PERF_COUNTER_CYCLES] ? (double)c->values[PERF_COUNTER_CYCLES] : 0;
+                double kilobytes = bytes / 1024;
+                printf("%-6d %-7s", level, bench_phase_names[phase]);
+                print_counter(c, PERF_COUNTER_CYCLES, bytes);
+                print_counter(c, PERF_COUNTER_INSTRUCTIONS, cycles);
+                print_counter(c, PERF_COUNTER_BRANCH_MISSES, kilobytes);
+                print_counter(c, PERF_COUNTER_L1D_MISSES, kilobytes);
+                print_counter(c, PERF_COUNTER_LLC_MISSES, kilobytes);
+                printf("\n");
+            }
+        }
+        perf_counters_close(&phase_counters);
+    }
+    huffman_decoder_deinit(&decoder);
+}
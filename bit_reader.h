@@ -1,6 +1,7 @@
 #pragma once
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef struct {
     void* userdata;
@@ -13,7 +14,20 @@ typedef struct {
     size_t cursor;
 } BitReaderUserdata;
 
-bool read_bit(void* reader_data, bool* bit) {
+typedef struct {
+    const unsigned char* data;
+    size_t len;
+    size_t bit_offset;
+} BitReaderMemoryUserdata;
+
+bool file_read_bit(void* reader_data, bool* bit);
+bool memory_read_bit(void* reader_data, bool* bit);
+bool read_byte(BitReader reader, unsigned char* byte);
+bool read_bits(BitReader reader, size_t count, uint64_t* bits); // Most significant of the count bits first
+
+#ifdef BITREADER_IMPLEMENTATION
+
+bool file_read_bit(void* reader_data, bool* bit) {
     BitReaderUserdata* userdata = (BitReaderUserdata*)reader_data;
     if (userdata->cursor) {
         userdata->cursor -= 1;
@@ -33,6 +47,15 @@ bool read_bit(void* reader_data, bool* bit) {
     return true;
 }
 
+bool memory_read_bit(void* reader_data, bool* bit) {
+    BitReaderMemoryUserdata* userdata = (BitReaderMemoryUserdata*)reader_data;
+    if (userdata->bit_offset >= userdata->len*8) return false;
+    unsigned char byte = userdata->data[userdata->bit_offset / 8];
+    *bit = byte & (0x80 >> (userdata->bit_offset % 8));
+    userdata->bit_offset += 1;
+    return true;
+}
+
 bool read_byte(BitReader reader, unsigned char* byte) {
     *byte = 0;
     for (size_t i = 0; i < 8; i++) {
@@ -42,3 +65,15 @@ bool read_byte(BitReader reader, unsigned char* byte) {
     }
     return true;
 }
+
+bool read_bits(BitReader reader, size_t count, uint64_t* bits) {
+    *bits = 0;
+    for (size_t i = 0; i < count; i++) {
+        bool bit = false;
+        if (!reader.read_bit(reader.userdata, &bit)) return false;
+        *bits = (*bits << 1) | bit;
+    }
+    return true;
+}
+
+#endif
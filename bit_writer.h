@@ -1,6 +1,7 @@
 #pragma once
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
 
 typedef struct {
     void* userdata;
@@ -14,14 +15,25 @@ typedef struct {
     size_t cursor;
 } BitWriterUserdata;
 
-bool write_bit(void* writer_data, bool bit);
+typedef struct {
+    unsigned char* data;
+    size_t capacity;
+    size_t len;
+    bool buffer[8];
+    size_t cursor;
+} BitWriterMemoryUserdata;
+
+bool file_write_bit(void* writer_data, bool bit);
+bool memory_write_bit(void* writer_data, bool bit);
+bool memory_flush(void* writer_data);
 bool write_bit_dbg(void* userdata, bool bit);
 bool write_byte(BitWriter writer, unsigned char byte);
-bool flush(void* writer_data);
+bool write_bits(BitWriter writer, uint64_t bits, size_t count); // Most significant of the count bits first
+bool file_flush(void* writer_data);
 
 #ifdef BITWRITER_IMPLEMENTATION
 
-bool write_bit(void* writer_data, bool bit) {
+bool file_write_bit(void* writer_data, bool bit) {
     BitWriterUserdata* userdata = (BitWriterUserdata*)writer_data;
     if (userdata->cursor < 7) {
         userdata->buffer[userdata->cursor++] = bit;
@@ -39,7 +51,7 @@ bool write_bit(void* writer_data, bool bit) {
     return true;
 }
 
-bool flush(void* writer_data) {
+bool file_flush(void* writer_data) {
     BitWriterUserdata* userdata = (BitWriterUserdata*)writer_data;
     if (userdata->cursor != 0) {
         unsigned char byte = 0;
@@ -52,6 +64,29 @@ bool flush(void* writer_data) {
     return true;
 }
 
+bool memory_write_bit(void* writer_data, bool bit) {
+    BitWriterMemoryUserdata* userdata = (BitWriterMemoryUserdata*)writer_data;
+    userdata->buffer[userdata->cursor++] = bit;
+    if (userdata->cursor == 8) {
+        unsigned char byte = 0;
+        for (size_t i = 0; i < 8; i++) {
+            byte |= ((unsigned char)userdata->buffer[i] << (7-i));
+        }
+        userdata->cursor = 0;
+        if (userdata->len >= userdata->capacity) return false;
+        userdata->data[userdata->len++] = byte;
+    }
+    return true;
+}
+
+bool memory_flush(void* writer_data) {
+    BitWriterMemoryUserdata* userdata = (BitWriterMemoryUserdata*)writer_data;
+    while (userdata->cursor != 0) {
+        if (!memory_write_bit(writer_data, false)) return false;
+    }
+    return true;
+}
+
 bool write_bit_dbg(void* userdata, bool bit) {
     (void)userdata;
     return printf("%c", (char)bit + '0') == 1;
@@ -71,4 +106,12 @@ bool write_byte(BitWriter writer, unsigned char byte) {
     return (result == 8);
 }
 
+bool write_bits(BitWriter writer, uint64_t bits, size_t count) {
+    bool ok = true;
+    for (size_t i = count-1; i < count; i--) {
+        ok &= writer.write_bit(writer.userdata, (bits >> i) & 1);
+    }
+    return ok;
+}
+
 #endif
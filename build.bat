@@ -2,4 +2,6 @@ mkdir build
 pushd build
 call clang -g -fsanitize=address,undefined ..\compress.c -o compress.exe 
 call clang -g -fsanitize=address,undefined ..\decompress.c -o decompress.exe 
+call clang -O2 ..\bench.c -o bench.exe
+call clang -g -fsanitize=address,undefined ..\test.c -o test.exe
 popd
@@ -2,4 +2,6 @@ mkdir build
 pushd build
 gcc ../compress.c -o compress
 gcc ../decompress.c -o decompress 
+gcc -O2 ../bench.c -o bench
+gcc -g -fsanitize=address,undefined ../test.c -o test
 popd
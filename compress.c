@@ -1,4 +1,6 @@
 #define _CRT_SECURE_NO_WARNINGS (1)
+// fileno and read are POSIX, not C
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stddef.h>
 #define ARENA_IMPLEMENTATION
@@ -6,8 +8,15 @@
 #include "arena.h"
 #include <stdint.h>
 #include <errno.h>
+#ifdef _WIN32
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
 #define BITWRITER_IMPLEMENTATION
 #include "bit_writer.h"
+#define BITREADER_IMPLEMENTATION
+#include "bit_reader.h"
 #define HUFFMAN_IMPLEMENTATION
 #include "huffman.h"
 
@@ -24,28 +33,120 @@ char* readfile(Arena* arena, char* path, size_t* len) {
     return string;
 }
 
+int compress_stream(char* infile, FILE* out, BitWriter writer, int level, size_t symbol_size) {
+    FILE* in = strcmp(infile, "-") == 0 ? stdin : fopen(infile, "rb");
+    if (!in) {
+        perror("File read failed");
+        return -1;
+    }
+    HuffmanEncoder encoder = {0};
+    if (!huffman_encoder_init(&encoder, 1<<26, level)) {
+        printf("Failed to create encoder\n");
+        return -1;
+    }
+    if (!huffman_encoder_set_symbol_size(&encoder, symbol_size)) {
+        printf("Failed to create encoder\n");
+        return -1;
+    }
+    // Code whatever has arrived instead of waiting for the whole input: read
+    // returns as soon as a pipe has any data, and the coded bytes are passed
+    // on before waiting for more
+    static char chunk[1<<16];
+#ifdef _WIN32
+    int fd = _fileno(in);
+#else
+    int fd = fileno(in);
+#endif
+    while (true) {
+#ifdef _WIN32
+        ptrdiff_t chunk_len = _read(fd, chunk, sizeof(chunk));
+#else
+        ptrdiff_t chunk_len = read(fd, chunk, sizeof(chunk));
+#endif
+        if (chunk_len < 0 && errno == EINTR) continue;
+        if (chunk_len < 0) {
+            perror("File read failed");
+            return -1;
+        }
+        if (chunk_len == 0) break;
+        if (!huffman_encoder_stream_write(&encoder, writer, chunk, (size_t)chunk_len)) {
+            perror("Failed to encode message");
+            return -1;
+        }
+        fflush(out);
+    }
+    if (!huffman_encoder_stream_end(&encoder, writer)) {
+        perror("Failed to encode message");
+        return -1;
+    }
+    huffman_encoder_deinit(&encoder);
+    return 0;
+}
+
 int main(int argc, char** argv) {
+    int level = HUFFMAN_LEVEL_DEFAULT;
+    bool stream = false;
+    bool append = false;
+    size_t symbol_size = 1;
+    while (argc > 3 && argv[1][0] == '-') {
+        if (argv[1][1] >= '1' && argv[1][1] <= '9' && argv[1][2] == 0) {
+            level = argv[1][1] - '0';
+        }
+        else if (strcmp(argv[1], "--stream") == 0) {
+            stream = true;
+        }
+        else if (strcmp(argv[1], "--16") == 0) {
+            symbol_size = 2;
+        }
+        else if (strcmp(argv[1], "--append") == 0) {
+            append = true;
+        }
+        else {
+            break;
+        }
+        argv += 1;
+        argc -= 1;
+    }
     if (argc != 3) {
-        printf("Usage: compress <infile> <outfile>\n");
+        printf("Usage: compress [-1..-9] [--stream] [--16] [--append] <infile> <outfile>\n");
         return -1;
     }
     char* infile = argv[1];
     char* outfile = argv[2];
+
+    // Every message is a frame ending on a byte boundary, appending one adds
+    // to what the file decompresses to without touching the earlier frames
+    FILE* out = fopen(outfile, append ? "ab" : "wb");
+    BitWriterUserdata usrdata = {.f = out };
+    BitWriter writer = {
+        .write_bit = file_write_bit,
+        .flush = file_flush,
+        .userdata = &usrdata,
+    };
+    if (stream) {
+        int result = compress_stream(infile, out, writer, level, symbol_size);
+        fclose(out);
+        return result;
+    }
+
     Arena arena = arena_init(1000000000);
     size_t msg_len = 0;
     char* msg = readfile(&arena, infile, &msg_len); 
     if (errno != 0) perror("File read failed\n");
     
-    FILE* out = fopen(outfile, "wb");
-    BitWriterUserdata usrdata = {.f = out };
-    BitWriter writer = {
-        .write_bit = write_bit,
-        .flush = flush,
-        .userdata = &usrdata,
-    };
-    if (!huffman_write(arena, writer, msg, msg_len)) {
+    HuffmanEncoder encoder = {0};
+    if (!huffman_encoder_init(&encoder, 1<<28, level)) {
+        printf("Failed to create encoder\n");
+        return -1;
+    }
+    if (!huffman_encoder_set_symbol_size(&encoder, symbol_size)) {
+        printf("Failed to create encoder\n");
+        return -1;
+    }
+    if (!huffman_encoder_write(&encoder, writer, msg, msg_len)) {
         perror("Failed to encode message");
         return -1;
     }
+    huffman_encoder_deinit(&encoder);
     fclose(out);
 }
@@ -0,0 +1,75 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Instruction set levels kernels are built for, each implies the previous ones
+typedef enum {
+    CPU_VARIANT_SCALAR,
+    CPU_VARIANT_BMI2, // BMI1, BMI2 and MOVBE
+    CPU_VARIANT_COUNT,
+} CpuVariant;
+
+extern const char* cpu_variant_names[CPU_VARIANT_COUNT];
+
+CpuVariant cpu_detect_variant(void); // Best variant this CPU and OS support
+// Best variant, or the one named by the environment variable if this CPU supports it
+CpuVariant cpu_select_variant(const char* env_var);
+
+#ifdef CPU_FEATURES_IMPLEMENTATION
+
+const char* cpu_variant_names[CPU_VARIANT_COUNT] = {
+    [CPU_VARIANT_SCALAR] = "scalar",
+    [CPU_VARIANT_BMI2] = "bmi2",
+};
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    #ifdef _MSC_VER
+        #include <intrin.h>
+        void cpu_impl_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+            int result[4];
+            __cpuidex(result, (int)leaf, (int)subleaf);
+            for (size_t i = 0; i < 4; i++) regs[i] = (uint32_t)result[i];
+        }
+    #else
+        #include <cpuid.h>
+        void cpu_impl_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+            regs[0] = regs[1] = regs[2] = regs[3] = 0;
+            __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+        }
+    #endif // _MSC_VER
+
+    // BMI and MOVBE work on general purpose registers, so unlike AVX they
+    // need nothing from the OS
+    CpuVariant cpu_detect_variant(void) {
+        uint32_t regs[4] = {0}; // eax, ebx, ecx, edx
+        cpu_impl_cpuid(0, 0, regs);
+        uint32_t max_leaf = regs[0];
+        if (max_leaf < 7) return CPU_VARIANT_SCALAR;
+        cpu_impl_cpuid(1, 0, regs);
+        bool movbe = regs[2] & (1u << 22);
+        cpu_impl_cpuid(7, 0, regs);
+        bool bmi1 = regs[1] & (1u << 3);
+        bool bmi2 = regs[1] & (1u << 8);
+        if (!movbe || !bmi1 || !bmi2) return CPU_VARIANT_SCALAR;
+        return CPU_VARIANT_BMI2;
+    }
+#else
+    CpuVariant cpu_detect_variant(void) {
+        return CPU_VARIANT_SCALAR;
+    }
+#endif
+
+CpuVariant cpu_select_variant(const char* env_var) {
+    CpuVariant best = cpu_detect_variant();
+    const char* forced = env_var ? getenv(env_var) : 0;
+    if (!forced) return best;
+    for (size_t i = 0; i <= (size_t)best; i++) {
+        if (strcmp(forced, cpu_variant_names[i]) == 0) return (CpuVariant)i;
+    }
+    // Unknown names and variants this CPU cannot run are ignored
+    return best;
+}
+
+#endif // CPU_FEATURES_IMPLEMENTATION
@@ -1,6 +1,7 @@
 #define _CRT_SECURE_NO_WARNINGS (1)
 #include <stdio.h>
 #include <stddef.h>
+#include <stdlib.h>
 #define ARENA_IMPLEMENTATION
 #define ARENA_BACKEND_MALLOC
 #include "arena.h"
@@ -13,25 +14,62 @@
 #define HUFFMAN_IMPLEMENTATION
 #include "huffman.h"
 
+char* readfile(Arena* arena, char* path, size_t* len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    fseek(f, 0, SEEK_END);
+    size_t fsize = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *string = arena_alloc_ex(arena, fsize+1, ARENA_FLAG_ASAN_SEPARATION, 1, 1);
+    fread(string, fsize, 1, f);
+    fclose(f);
+    string[fsize] = 0;
+    *len = fsize;
+    return string;
+}
+
 int main(int argc, char** argv) {
+    size_t thread_count = 1;
+    if (argc > 4 && strcmp(argv[1], "--threads") == 0) {
+        thread_count = strtoul(argv[2], 0, 10);
+        argv += 2;
+        argc -= 2;
+    }
     if (argc != 3) {
-        printf("Usage: decompress <infile> <outfile>\n");
+        printf("Usage: decompress [--threads n] <infile> <outfile>\n");
         return -1;
     }
     char* infile = argv[1];
     char* outfile = argv[2];
     Arena arena = arena_init(1000000000);
-    FILE* in = fopen(infile, "rb");
-    BitReaderUserdata reader_data = {
-        .f = in,
+    size_t in_len = 0;
+    char* in = readfile(&arena, infile, &in_len);
+    if (!in) {
+        perror("File read failed");
+        return -1;
+    }
+    BitReaderMemoryUserdata reader_data = {
+        .data = (unsigned char*)in,
+        .len = in_len,
     };
     BitReader reader = {
         .userdata = &reader_data,
-        .read_bit = read_bit,
+        .read_bit = memory_read_bit,
     };
+    HuffmanDecoder decoder = {0};
+    if (!huffman_decoder_init(&decoder, 1<<25)) {
+        printf("Failed to create decoder\n");
+        return -1;
+    }
+    huffman_decoder_set_threads(&decoder, thread_count);
     size_t decoded_len = 0;
     bool ok = true;
-    char* decoded = huffman_read(&arena, reader, &decoded_len, &ok);
+    char* decoded = huffman_decoder_read(&decoder, &arena, reader, &decoded_len, &ok);
+    huffman_decoder_deinit(&decoder);
+    if (!ok) {
+        printf("Failed to decode message\n");
+        return -1;
+    }
     //printf("%.*s\n", (int)msg_len, msg);
     //printf("%.*s\n", (int)decoded_len, decoded);
     FILE* f = fopen(outfile, "wb");
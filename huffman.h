@@ -5,69 +5,537 @@
 #include "bit_reader.h"
 
 
+#define HUFFMAN_LEVEL_FASTEST (1)
+#define HUFFMAN_LEVEL_DEFAULT (6)
+#define HUFFMAN_LEVEL_MAX (9)
+
+// Longest code the encoder will emit, at every level
+#define HUFFMAN_MAX_CODE_LEN (32)
+
+// Symbols are bytes or little endian 16-bit words
+#define HUFFMAN_MAX_SYMBOL_SIZE (2)
+#define HUFFMAN_MAX_ALPHABET (1<<16)
+
+struct Node;
+struct HuffmanTable;
+struct HuffmanHistogram;
+struct HuffmanDecodeTable;
+struct HuffmanAnsTable;
+struct HuffmanAnsDecodeTable;
+struct HuffmanTableCache;
+struct HuffmanLegacyTree;
+struct HuffmanPushEncoder;
+struct HuffmanPushDecoder;
+
+// Encoder and decoder contexts own all of their state, one context per thread.
+// Reset and reuse them across messages instead of reinitialising.
+typedef struct {
+    Arena scratch;
+    int level;
+    size_t symbol_size;
+    size_t alphabet_capacity; // Symbols the tables and histograms have room for, grown for 16-bit symbols
+    struct HuffmanTable* table;
+    struct HuffmanTable* previous_table;
+    bool has_previous;
+    struct HuffmanHistogram* histogram;
+    struct HuffmanHistogram* default_model; // Statistics the first adaptive block starts from
+    struct HuffmanHistogram* model;
+    struct HuffmanAnsTable* ans_table; // Normalized counts for blocks coded with tANS
+    unsigned char carry; // Odd byte of a 16-bit stream waiting for its partner
+    bool has_carry;
+    bool frame_started; // Streaming or push coding wrote the frame header but not the end marker
+    struct HuffmanPushEncoder* push; // Created on first use of huffman_encoder_push
+    BitWriterMemoryUserdata bits;
+} HuffmanEncoder;
+
+typedef struct {
+    Arena scratch;
+    size_t alphabet_capacity; // Symbols the tables and histograms have room for, grown for 16-bit symbols
+    struct HuffmanTable* table;
+    struct HuffmanDecodeTable* decode_table; // In use, either built_table or one from the table cache
+    struct HuffmanDecodeTable* built_table;
+    bool has_table;
+    bool in_frame; // The frame header was read
+    bool legacy; // The frame is in the format of the first version, without a header
+    struct HuffmanLegacyTree* legacy_tree; // Created for the first legacy frame
+    struct HuffmanAnsTable* ans_table; // Of the current tANS block, the Huffman table stays for later blocks
+    struct HuffmanAnsDecodeTable* ans_decode_table;
+    unsigned char flags;
+    struct HuffmanHistogram* histogram;
+    struct HuffmanHistogram* default_model;
+    struct HuffmanHistogram* model;
+    size_t thread_count;
+    struct HuffmanTableCache* table_cache; // Created by huffman_decoder_set_table_cache
+    struct HuffmanPushDecoder* push; // Created on first use of huffman_decoder_push
+    BitReaderMemoryUserdata bits;
+} HuffmanDecoder;
+
+// Contexts start out with tables for bytes and grow them to 16-bit symbols on
+// first use, which takes about 3.5MB of the encoder's scratch and 3MB of the
+// decoder's. Init and whatever grows the tables fail if the scratch is too small.
+[[nodiscard]] bool huffman_encoder_init(HuffmanEncoder* encoder, ptrdiff_t scratch_size, int level);
+[[nodiscard]] bool huffman_encoder_set_symbol_size(HuffmanEncoder* encoder, size_t symbol_size); // 1 or 2 bytes, resets the default model
+void huffman_encoder_reset(HuffmanEncoder* encoder);
+void huffman_encoder_deinit(HuffmanEncoder* encoder);
+[[nodiscard]] bool huffman_encoder_write(HuffmanEncoder* encoder, BitWriter writer, const char* msg, size_t len);
+[[nodiscard]] bool huffman_encoder_compress(HuffmanEncoder* encoder, const char* msg, size_t len, unsigned char* out, size_t out_capacity, size_t* out_len);
+size_t huffman_compress_bound(size_t len);
+
+// Single-pass streaming: every chunk is coded as soon as it arrives with a table
+// derived from the statistics of the previous blocks, no table is transmitted.
+// Encoder and decoder must be given the same default model (NULL is uniform).
+[[nodiscard]] bool huffman_encoder_set_default_model(HuffmanEncoder* encoder, const int64_t* frequencies, size_t alphabet_size);
+[[nodiscard]] bool huffman_encoder_stream_write(HuffmanEncoder* encoder, BitWriter writer, const char* chunk, size_t len);
+[[nodiscard]] bool huffman_encoder_stream_end(HuffmanEncoder* encoder, BitWriter writer);
+
+[[nodiscard]] bool huffman_decoder_init(HuffmanDecoder* decoder, ptrdiff_t scratch_size);
+void huffman_decoder_reset(HuffmanDecoder* decoder);
+void huffman_decoder_deinit(HuffmanDecoder* decoder);
+[[nodiscard]] bool huffman_decoder_set_default_model(HuffmanDecoder* decoder, const int64_t* frequencies, size_t alphabet_size);
+// Large blocks read from memory are split across threads, see huffman_decoder_read_block_parallel
+void huffman_decoder_set_threads(HuffmanDecoder* decoder, size_t thread_count);
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions; // Misses that replaced a cached table
+} HuffmanTableCacheStats;
+
+// Keeps the decode tables of the last slot_count distinct transmitted tables
+// across messages, a message repeating one of them skips building its decode
+// table. 0 (the default) disables the cache, changing the size clears it.
+// Growing it keeps the decode tables it has, false if the scratch is too small.
+[[nodiscard]] bool huffman_decoder_set_table_cache(HuffmanDecoder* decoder, size_t slot_count);
+HuffmanTableCacheStats huffman_decoder_table_cache_stats(HuffmanDecoder* decoder);
+// Concatenated messages (frames) decode as the concatenation of their contents
+char* huffman_decoder_read(HuffmanDecoder* decoder, Arena* arena, BitReader reader, size_t* len, bool* ok);
+[[nodiscard]] bool huffman_decoder_decompress(HuffmanDecoder* decoder, const unsigned char* in, size_t in_len, char* out, size_t out_capacity, size_t* out_len);
+
+typedef enum {
+    HUFFMAN_PUSH_NEED_INPUT, // All input was taken, call again with more (or with finish set)
+    HUFFMAN_PUSH_NEED_OUTPUT, // The output buffer is full, call again with room
+    HUFFMAN_PUSH_DONE, // The message is complete
+    HUFFMAN_PUSH_ERROR,
+} HuffmanPushStatus;
+
+// Push-style coding for event loops: input is passed in fragments of any size
+// and output collected into buffers of any size. Each call does what it can
+// without waiting and keeps its place down to the bit, also inside headers and
+// tables. The first push of a message starts from a clean context, reset it
+// before the next message. The decoder stops at the end of each frame and
+// leaves the input after it unconsumed.
+HuffmanPushStatus huffman_encoder_push(HuffmanEncoder* encoder, const char* in, size_t in_len, bool finish, size_t* in_consumed, unsigned char* out, size_t out_capacity, size_t* out_len);
+HuffmanPushStatus huffman_decoder_push(HuffmanDecoder* decoder, const unsigned char* in, size_t in_len, size_t* in_consumed, char* out, size_t out_capacity, size_t* out_len);
+
 [[nodiscard]] bool huffman_write(Arena arena, BitWriter writer, char* msg, size_t len);
+[[nodiscard]] bool huffman_write_level(Arena arena, BitWriter writer, char* msg, size_t len, int level);
 char* huffman_read(Arena* arena, BitReader reader, size_t* len, bool* ok);
 
-#ifdef HUFFMAN_IMPLEMENTATION 
-    #ifdef HUFFMAN_IMPLEMENTATION 
-    #define HEAPQ_IMPLEMENTATION
+// Hot loops are built for several instruction sets, the best one the CPU
+// supports is picked on first use. HUFFMAN_CPU=scalar|bmi2 forces one.
+const char* huffman_kernels_name(void);
+
+#ifdef HUFFMAN_IMPLEMENTATION
+    #include <stdlib.h>
+    #define CPU_FEATURES_IMPLEMENTATION
+    #include "cpu_features.h"
+    #ifndef __STDC_NO_THREADS__
+        #include <threads.h>
     #endif
-    #include "heapq.h"
 
 typedef struct Node {
-    unsigned char symbol;
+    uint16_t symbol;
     struct Node* left;
     struct Node* right;
-    int64_t freq;
 } Node;
 
 typedef struct {
-    bool code[256];
-    size_t len;
+    uint32_t code; // Canonical code, sent from the most significant of its len bits
+    uint32_t len;
 } HuffmanTableEntry;
 
-typedef struct {
-    HuffmanTableEntry entries[256];
+// Tables and histograms keep a sorted list of the symbols in use next to the
+// dense per-symbol arrays, so a large alphabet only costs for what is used
+typedef struct HuffmanTable {
+    size_t alphabet_size;
+    size_t symbol_count;
+    uint16_t* symbols;
+    HuffmanTableEntry* entries;
 } HuffmanTable;
 
+typedef struct HuffmanHistogram {
+    size_t alphabet_size;
+    size_t symbol_count;
+    uint16_t* symbols;
+    int64_t* frequencies;
+    // Models only: the symbols counted at HUFFMAN_MODEL_DECAYING or more, the
+    // ones huffman_model_update decays
+    size_t decaying_count;
+    uint16_t* decaying;
+} HuffmanHistogram;
+
+typedef struct {
+    int64_t freq;
+    uint32_t node;
+} HuffmanLeaf;
+
+// The first version sent a single table per message: the number of entries in a
+// byte (0 for all 256), then per entry the symbol byte, its code length in nobfel
+// bits and the code. The codes came from the encoder's tree rather than being
+// canonical, so codes longer than the lookup are decoded by walking that tree.
+#define HUFFMAN_LEGACY_MAX_NODES (2*256)
+
+typedef struct {
+    uint16_t child[2]; // By the next bit, 0 if there is none since the root is nobody's child
+    int16_t symbol; // -1 for inner nodes
+} HuffmanLegacyNode;
+
+typedef struct HuffmanLegacyTree {
+    HuffmanLegacyNode nodes[HUFFMAN_LEGACY_MAX_NODES];
+    size_t node_count;
+} HuffmanLegacyTree;
+
+// Codes up to HUFFMAN_LOOKUP_BITS long decode with one lookup, longer
+// ones through the canonical code ranges of each length
+#define HUFFMAN_LOOKUP_BITS (11)
+
+typedef struct {
+    uint16_t symbol; // For longer legacy codes, the tree node after the lookup's bits
+    uint16_t len; // 0 if the code is longer than HUFFMAN_LOOKUP_BITS
+} HuffmanLookupEntry;
+
+typedef struct HuffmanDecodeTable {
+    HuffmanLookupEntry lookup[1<<HUFFMAN_LOOKUP_BITS];
+    uint32_t first_code[HUFFMAN_MAX_CODE_LEN+1];
+    uint32_t count[HUFFMAN_MAX_CODE_LEN+1];
+    uint32_t offset[HUFFMAN_MAX_CODE_LEN+1]; // Of the first symbol of each length in symbols
+    size_t max_len;
+    uint16_t* symbols; // Ordered by code length
+    const HuffmanLegacyTree* legacy_tree; // Walked past the lookup instead of the canonical ranges
+} HuffmanDecodeTable;
+
+// Recently transmitted tables, found by a fingerprint of their symbols and
+// code lengths
+typedef struct {
+    uint64_t fingerprint;
+    uint64_t last_use; // 0 while the slot is empty
+    HuffmanDecodeTable* decode_table;
+} HuffmanTableCacheSlot;
+
+typedef struct HuffmanTableCache {
+    HuffmanTableCacheSlot* slots;
+    size_t slot_count;
+    size_t capacity; // Slots allocated, kept when the cache shrinks
+    uint64_t clock;
+    HuffmanTableCacheStats stats;
+} HuffmanTableCache;
+
+// tANS blocks code with a state machine over symbol counts normalized to
+// HUFFMAN_ANS_STATES, which spends fractions of a bit where a Huffman code
+// spends at least one
+#define HUFFMAN_ANS_TABLE_LOG (12)
+#define HUFFMAN_ANS_STATES (1<<HUFFMAN_ANS_TABLE_LOG)
+// Blocks using more symbols are left to Huffman, their counts would be too coarse
+#define HUFFMAN_ANS_MAX_SYMBOLS (HUFFMAN_ANS_STATES/4)
+// Permille a tANS block must save over Huffman, its decoding is a little slower
+#define HUFFMAN_ANS_MARGIN (20)
+
+typedef struct {
+    int32_t delta_bits; // (state + delta_bits) >> 16 is the number of bits the state sheds
+    int32_t delta_state; // Added to the remaining state to index the state table
+} HuffmanAnsTransform;
+
+typedef struct {
+    uint16_t symbol;
+    uint16_t base; // The next state is base plus the next bit_count bits
+    uint8_t bit_count;
+} HuffmanAnsDecodeEntry;
+
+typedef struct HuffmanAnsTable {
+    size_t alphabet_size;
+    size_t symbol_count;
+    uint16_t* symbols;
+    uint16_t* counts; // Sum to HUFFMAN_ANS_STATES over symbols
+} HuffmanAnsTable;
+
+typedef struct HuffmanAnsDecodeTable {
+    HuffmanAnsDecodeEntry entries[HUFFMAN_ANS_STATES];
+} HuffmanAnsDecodeTable;
+
+#define HUFFMAN_KERNEL_SUFFIX scalar
+#include "huffman_kernels.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+    #include <immintrin.h>
+    #define HUFFMAN_KERNELS_X86
+    // Variable shifts dominate bit packing and unpacking, BMI2 makes them single
+    // uops. MOVBE loads and stores the big endian bit stream in one instruction.
+    #define HUFFMAN_KERNEL_SUFFIX bmi2
+    #define HUFFMAN_KERNEL_ATTRIBUTES __attribute__((target("bmi,bmi2,movbe")))
+    #define HUFFMAN_KERNEL_BMI2
+    #include "huffman_kernels.h"
+#endif
+
+typedef struct {
+    void (*histogram)(const unsigned char* msg, size_t symbol_count, size_t symbol_size, HuffmanHistogram* histogram);
+    bool (*encode)(const HuffmanTableEntry* entries, const unsigned char* msg, size_t symbol_count, size_t symbol_size, BitWriterMemoryUserdata* out);
+    bool (*decode)(const HuffmanDecodeTable* table, BitReaderMemoryUserdata* in, unsigned char* out, size_t symbol_count, size_t symbol_size);
+    bool (*scan)(const HuffmanDecodeTable* table, const unsigned char* data, size_t len, size_t bit_offset, size_t end_bit, size_t* boundaries, size_t boundary_capacity, unsigned char* out, size_t symbol_size, size_t* exit_bit, size_t* symbol_count);
+    void (*ans_encode)(const HuffmanAnsTransform* transforms, const uint16_t* states, const unsigned char* msg, size_t symbol_count, size_t symbol_size, uint32_t* chunks, uint32_t* final_states);
+    bool (*pack)(const uint32_t* chunks, size_t chunk_count, BitWriterMemoryUserdata* out);
+    bool (*ans_decode)(const HuffmanAnsDecodeEntry* table, BitReaderMemoryUserdata* in, unsigned char* out, size_t symbol_count, size_t symbol_size, uint32_t* states);
+} HuffmanKernels;
+
+const HuffmanKernels huffman_kernel_variants[CPU_VARIANT_COUNT] = {
+    [CPU_VARIANT_SCALAR] = {huffman_histogram_kernel_scalar, huffman_encode_kernel_scalar, huffman_decode_kernel_scalar, huffman_scan_kernel_scalar, huffman_ans_encode_kernel_scalar, huffman_pack_kernel_scalar, huffman_ans_decode_kernel_scalar},
+#ifdef HUFFMAN_KERNELS_X86
+    [CPU_VARIANT_BMI2] = {huffman_histogram_kernel_bmi2, huffman_encode_kernel_bmi2, huffman_decode_kernel_bmi2, huffman_scan_kernel_bmi2, huffman_ans_encode_kernel_bmi2, huffman_pack_kernel_bmi2, huffman_ans_decode_kernel_bmi2},
+#endif
+};
+
+// Chosen once, every later call sees the same variant. Without threads.h the
+// library starts no threads, callers that start their own pick the variant
+// first by calling huffman_kernels_name.
+CpuVariant huffman_kernels_variant = CPU_VARIANT_COUNT;
+
+void huffman_kernels_select(void) {
+    huffman_kernels_variant = cpu_select_variant("HUFFMAN_CPU");
+}
+
+const HuffmanKernels* huffman_kernels(void) {
+#ifndef __STDC_NO_THREADS__
+    static once_flag selected = ONCE_FLAG_INIT;
+    call_once(&selected, huffman_kernels_select);
+#else
+    if (huffman_kernels_variant == CPU_VARIANT_COUNT) huffman_kernels_select();
+#endif
+    return &huffman_kernel_variants[huffman_kernels_variant];
+}
+
+const char* huffman_kernels_name(void) {
+    huffman_kernels();
+    return cpu_variant_names[huffman_kernels_variant];
+}
+
+typedef enum {
+    HUFFMAN_BLOCK_LAST = 1,
+    HUFFMAN_BLOCK_REUSE_TABLE = 2,
+    HUFFMAN_BLOCK_ADAPTIVE_TABLE = 4, // Table built from the adaptive model, not transmitted
+    HUFFMAN_BLOCK_WIDE_SYMBOLS = 8, // 16-bit symbols
+    HUFFMAN_BLOCK_TRAILING_BYTE = 16, // Raw byte after the payload, the odd end of a 16-bit message
+    HUFFMAN_BLOCK_ANS = 32, // tANS coded with its own table of counts, leaves the Huffman table alone
+} HuffmanBlockFlags;
+
+// Every frame starts with the magic and the format version. The first version
+// wrote neither, its streams start with a byte of at most 8 and are still read.
+const unsigned char huffman_frame_magic[3] = {'H', 'U', 'F'};
+#define HUFFMAN_FORMAT_VERSION (1)
+#define HUFFMAN_FRAME_HEADER_SIZE (4)
+
+typedef struct {
+    size_t block_size;
+    size_t sample_step; // Histogram counts every n-th byte, 1 is exact
+    size_t reuse_slack; // Permille of extra cost accepted to keep the previous table
+    size_t min_split_size; // Smallest block the boundary search may produce, 0 disables the search
+} HuffmanLevelParams;
+
+const HuffmanLevelParams huffman_level_params[HUFFMAN_LEVEL_MAX+1] = {
+    [1] = {.block_size = 1<<20, .sample_step = 16, .reuse_slack = 50},
+    [2] = {.block_size = 1<<19, .sample_step = 8, .reuse_slack = 30},
+    [3] = {.block_size = 1<<18, .sample_step = 4, .reuse_slack = 15},
+    [4] = {.block_size = 1<<18, .sample_step = 1},
+    [5] = {.block_size = 1<<19, .sample_step = 1},
+    [6] = {.block_size = 1<<20, .sample_step = 1},
+    [7] = {.block_size = 1<<20, .sample_step = 1, .min_split_size = 1<<16},
+    [8] = {.block_size = 1<<20, .sample_step = 1, .min_split_size = 1<<14},
+    [9] = {.block_size = 1<<20, .sample_step = 1, .min_split_size = 1<<12},
+};
+
+// Code length limits tried by the levels with a block boundary search
+const size_t huffman_code_len_candidates[] = {HUFFMAN_MAX_CODE_LEN, 15, 12, 11, 10, 9, 8};
+
+
 
+int huffman_compare_leaves(const void* av, const void* bv) {
+    const HuffmanLeaf* a = (const HuffmanLeaf*)av;
+    const HuffmanLeaf* b = (const HuffmanLeaf*)bv;
+    if (a->freq != b->freq) return a->freq < b->freq ? -1 : 1;
+    return a->node < b->node ? -1 : a->node > b->node;
+}
+
+int huffman_compare_symbols(const void* av, const void* bv) {
+    uint16_t a = *(const uint16_t*)av;
+    uint16_t b = *(const uint16_t*)bv;
+    return (a > b) - (a < b);
+}
+
+size_t huffman_alphabet_size(size_t symbol_size) {
+    return (size_t)1 << (8*symbol_size);
+}
+
+uint32_t huffman_symbol(const unsigned char* msg, size_t i, size_t symbol_size) {
+    if (symbol_size == 2) return msg[2*i] | ((uint32_t)msg[2*i+1] << 8);
+    return msg[i];
+}
+
+void huffman_table_init(Arena* arena, HuffmanTable* table, size_t capacity) {
+    *table = (HuffmanTable){
+        .symbols = arena_new(arena, uint16_t, capacity),
+        .entries = arena_new(arena, HuffmanTableEntry, capacity),
+    };
+}
+
+void huffman_table_clear(HuffmanTable* table, size_t alphabet_size) {
+    for (size_t i = 0; i < table->symbol_count; i++) {
+        table->entries[table->symbols[i]] = (HuffmanTableEntry){0};
+    }
+    table->symbol_count = 0;
+    table->alphabet_size = alphabet_size;
+}
+
+void huffman_table_copy(HuffmanTable* dst, HuffmanTable* src) {
+    huffman_table_clear(dst, src->alphabet_size);
+    for (size_t i = 0; i < src->symbol_count; i++) {
+        uint16_t symbol = src->symbols[i];
+        dst->symbols[i] = symbol;
+        dst->entries[symbol] = src->entries[symbol];
+    }
+    dst->symbol_count = src->symbol_count;
+}
+
+void huffman_histogram_init(Arena* arena, HuffmanHistogram* histogram, size_t capacity) {
+    *histogram = (HuffmanHistogram){
+        .symbols = arena_new(arena, uint16_t, capacity),
+        .frequencies = arena_new(arena, int64_t, capacity),
+        .decaying = arena_new(arena, uint16_t, capacity),
+    };
+}
+
+void huffman_histogram_clear(HuffmanHistogram* histogram, size_t alphabet_size) {
+    for (size_t i = 0; i < histogram->symbol_count; i++) {
+        histogram->frequencies[histogram->symbols[i]] = 0;
+    }
+    histogram->symbol_count = 0;
+    histogram->decaying_count = 0;
+    histogram->alphabet_size = alphabet_size;
+}
+
+// Rebuilds the symbol list after frequencies were written directly
+void huffman_histogram_collect(HuffmanHistogram* histogram) {
+    histogram->symbol_count = 0;
+    for (size_t i = 0; i < histogram->alphabet_size; i++) {
+        if (histogram->frequencies[i]) histogram->symbols[histogram->symbol_count++] = i;
+    }
+}
+
+// Puts the symbols appended by the histogram kernel in ascending order. Sorting
+// a few symbols beats scanning 64Ki counts, most of the alphabet is rescanned.
+void huffman_histogram_sort(HuffmanHistogram* histogram) {
+    if (histogram->symbol_count*16 >= histogram->alphabet_size) {
+        huffman_histogram_collect(histogram);
+        return;
+    }
+    qsort(histogram->symbols, histogram->symbol_count, sizeof(uint16_t), huffman_compare_symbols);
+}
+
+void huffman_histogram_copy(HuffmanHistogram* dst, HuffmanHistogram* src) {
+    huffman_histogram_clear(dst, src->alphabet_size);
+    for (size_t i = 0; i < src->symbol_count; i++) {
+        uint16_t symbol = src->symbols[i];
+        dst->symbols[i] = symbol;
+        dst->frequencies[symbol] = src->frequencies[symbol];
+    }
+    dst->symbol_count = src->symbol_count;
+    memcpy(dst->decaying, src->decaying, src->decaying_count*sizeof(uint16_t));
+    dst->decaying_count = src->decaying_count;
+}
+
+// Arena allocations are padded to their alignment and, under ASan, separated
+#define HUFFMAN_ALLOCATION_SLACK (32)
 
-Ordering cmp_nodes(void* userdata, void* av, void* bv) {
-    (void)userdata;
-    Node* a = (Node*)av;
-    Node* b = (Node*)bv;
-    if (a->freq == b->freq) return Ordering_Equal;
-    else if (a->freq < b->freq) return Ordering_LessThan;
-    else return Ordering_GreaterThan;
+// The arena asserts when it runs out, so anything that may not fit checks first
+bool huffman_arena_has_room(Arena* arena, size_t bytes, size_t allocation_count) {
+    return bytes + allocation_count*HUFFMAN_ALLOCATION_SLACK <= (size_t)(arena->reserved_length - arena->offset);
 }
 
+size_t huffman_table_bytes(size_t capacity) {
+    return capacity*(sizeof(uint16_t) + sizeof(HuffmanTableEntry));
+}
+
+size_t huffman_histogram_bytes(size_t capacity) {
+    return capacity*(2*sizeof(uint16_t) + sizeof(int64_t));
+}
+
+// Moves the table to arrays with room for capacity symbols, keeping its contents
+void huffman_table_grow(Arena* arena, HuffmanTable* table, size_t old_capacity, size_t capacity) {
+    HuffmanTable grown = {0};
+    huffman_table_init(arena, &grown, capacity);
+    if (old_capacity) {
+        memcpy(grown.symbols, table->symbols, old_capacity*sizeof(uint16_t));
+        memcpy(grown.entries, table->entries, old_capacity*sizeof(HuffmanTableEntry));
+    }
+    grown.alphabet_size = table->alphabet_size;
+    grown.symbol_count = table->symbol_count;
+    *table = grown;
+}
+
+void huffman_histogram_grow(Arena* arena, HuffmanHistogram* histogram, size_t old_capacity, size_t capacity) {
+    HuffmanHistogram grown = {0};
+    huffman_histogram_init(arena, &grown, capacity);
+    if (old_capacity) {
+        memcpy(grown.symbols, histogram->symbols, old_capacity*sizeof(uint16_t));
+        memcpy(grown.frequencies, histogram->frequencies, old_capacity*sizeof(int64_t));
+        memcpy(grown.decaying, histogram->decaying, old_capacity*sizeof(uint16_t));
+    }
+    grown.alphabet_size = histogram->alphabet_size;
+    grown.symbol_count = histogram->symbol_count;
+    grown.decaying_count = histogram->decaying_count;
+    *histogram = grown;
+}
+
+void huffman_histogram_uniform(HuffmanHistogram* histogram, size_t alphabet_size) {
+    histogram->alphabet_size = alphabet_size;
+    for (size_t i = 0; i < alphabet_size; i++) {
+        histogram->frequencies[i] = 1;
+        histogram->symbols[i] = i;
+    }
+    histogram->symbol_count = alphabet_size;
+    histogram->decaying_count = 0;
+}
 
 void print_huffman_table(HuffmanTable* huffman_table) {
-    for (size_t i = 0; i < 256; i++) {
-        HuffmanTableEntry* entry = &huffman_table->entries[i];
-        if (entry->len) {
-            printf("%c: ", (unsigned char)i);
-            for (size_t i = 0; i < entry->len; i++) {
-                printf("%c", entry->code[i] + '0');
-            }
-            printf("\n");
+    for (size_t i = 0; i < huffman_table->symbol_count; i++) {
+        uint16_t symbol = huffman_table->symbols[i];
+        HuffmanTableEntry* entry = &huffman_table->entries[symbol];
+        printf("%u: ", symbol);
+        for (size_t i = entry->len-1; i < entry->len; i--) {
+            printf("%c", (char)((entry->code >> i) & 1) + '0');
         }
+        printf("\n");
     }
 }
 
-void write_encoded_message(HuffmanTable* huffman_table, BitWriter writer, const unsigned char* msg, size_t msg_len) {
-    assert(msg_len < 0xFFFFFFFF);
-    write_byte(writer, (msg_len & 0xFF000000) >> (8*3));
-    write_byte(writer, (msg_len & 0x00FF0000) >> (8*2));
-    write_byte(writer, (msg_len & 0x0000FF00) >> (8*1));
-    write_byte(writer, (msg_len & 0x000000FF) >> (8*0));
-    //printf("Writing length %zu\n", msg_len);
-    for (size_t i = 0; i < msg_len; i++) {
-        HuffmanTableEntry* entry = &huffman_table->entries[msg[i]];
-        for (size_t i = 0; i < entry->len; i++) {
-            writer.write_bit(writer.userdata, entry->code[i]);
-        }
+bool write_encoded_message_length(BitWriter writer, size_t symbol_count) {
+    assert(symbol_count < 0xFFFFFFFF);
+    bool ok = true;
+    ok &= write_byte(writer, (symbol_count & 0xFF000000) >> (8*3));
+    ok &= write_byte(writer, (symbol_count & 0x00FF0000) >> (8*2));
+    ok &= write_byte(writer, (symbol_count & 0x0000FF00) >> (8*1));
+    ok &= write_byte(writer, (symbol_count & 0x000000FF) >> (8*0));
+    //printf("Writing length %zu\n", symbol_count);
+    return ok;
+}
+
+bool write_encoded_message(HuffmanTable* huffman_table, BitWriter writer, const unsigned char* msg, size_t symbol_count, size_t symbol_size) {
+    bool ok = write_encoded_message_length(writer, symbol_count);
+    if (writer.write_bit == memory_write_bit) {
+        return ok && huffman_kernels()->encode(huffman_table->entries, msg, symbol_count, symbol_size, writer.userdata);
     }
+    for (size_t i = 0; i < symbol_count; i++) {
+        HuffmanTableEntry* entry = &huffman_table->entries[huffman_symbol(msg, i, symbol_size)];
+        ok &= write_bits(writer, entry->code, entry->len);
+    }
+    return ok;
 }
 
 size_t read_encoded_message_length(BitReader reader) {
@@ -84,197 +552,2183 @@ size_t read_encoded_message_length(BitReader reader) {
     return length;
 }
 
-unsigned char read_encoded_message_byte(Node* root, BitReader reader) {
-    assert(root);
-    if (root->symbol) {
-        return root->symbol;
+// One bit at a time for readers without the memory fast path
+bool read_encoded_message_symbol(HuffmanDecodeTable* table, BitReader reader, uint16_t* symbol) {
+    uint64_t code = 0;
+    for (size_t len = 1; len <= table->max_len; len++) {
+        bool bit = false;
+        if (!reader.read_bit(reader.userdata, &bit)) return false;
+        code = (code << 1) | bit;
+        uint64_t index = code - table->first_code[len];
+        if (index < table->count[len]) {
+            *symbol = table->symbols[table->offset[len] + index];
+            return true;
+        }
+    }
+    // Codes the table left unused
+    return false;
+}
+
+void write_symbol(unsigned char* out, size_t i, size_t symbol_size, uint16_t symbol) {
+    if (symbol_size == 2) {
+        out[2*i] = symbol & 0xFF;
+        out[2*i+1] = symbol >> 8;
     }
     else {
-        bool bit = false;
-        read_bit(reader.userdata, &bit);
-        if (bit) {
-            return read_encoded_message_byte(root->left, reader);
+        out[i] = (unsigned char)symbol;
+    }
+}
+
+// Elias gamma code, used for the gaps between the symbols of a sparse table
+size_t huffman_gamma_bits(uint32_t value) {
+    size_t bits = 0;
+    while ((value >> bits) > 1) bits += 1;
+    return 2*bits + 1;
+}
+
+bool write_gamma(BitWriter writer, uint32_t value) {
+    assert(value > 0);
+    size_t bits = huffman_gamma_bits(value) / 2;
+    bool ok = write_bits(writer, 0, bits);
+    ok &= write_bits(writer, value, bits + 1);
+    return ok;
+}
+
+bool read_gamma(BitReader reader, uint32_t* value) {
+    size_t bits = 0;
+    bool bit = false;
+    while (true) {
+        if (!reader.read_bit(reader.userdata, &bit)) return false;
+        if (bit) break;
+        bits += 1;
+        if (bits > 16) return false;
+    }
+    uint64_t rest = 0;
+    if (!read_bits(reader, bits, &rest)) return false;
+    *value = (uint32_t)(((uint64_t)1 << bits) | rest);
+    return true;
+}
+
+size_t huffman_table_max_len(HuffmanTable* table) {
+    size_t max_len = 0;
+    for (size_t i = 0; i < table->symbol_count; i++) {
+        size_t len = table->entries[table->symbols[i]].len;
+        if (len > max_len) max_len = len;
+    }
+    return max_len;
+}
+
+// Canonical codes in symbol order, false if the lengths do not form a prefix code
+bool huffman_table_assign_codes(HuffmanTable* table) {
+    uint64_t length_counts[HUFFMAN_MAX_CODE_LEN+1] = {0};
+    for (size_t i = 0; i < table->symbol_count; i++) {
+        uint32_t len = table->entries[table->symbols[i]].len;
+        if (len == 0 || len > HUFFMAN_MAX_CODE_LEN) return false;
+        length_counts[len] += 1;
+    }
+    uint64_t kraft = 0;
+    uint64_t next_code[HUFFMAN_MAX_CODE_LEN+1] = {0};
+    uint64_t code = 0;
+    for (size_t len = 1; len <= HUFFMAN_MAX_CODE_LEN; len++) {
+        code = (code + length_counts[len-1]) << 1;
+        next_code[len] = code;
+        kraft += length_counts[len] << (HUFFMAN_MAX_CODE_LEN - len);
+    }
+    if (kraft > ((uint64_t)1 << HUFFMAN_MAX_CODE_LEN)) return false;
+    for (size_t i = 0; i < table->symbol_count; i++) {
+        HuffmanTableEntry* entry = &table->entries[table->symbols[i]];
+        entry->code = (uint32_t)next_code[entry->len]++;
+    }
+    return true;
+}
+
+size_t huffman_table_nobfel(HuffmanTable* table) {
+    size_t maximum_entry_len = huffman_table_max_len(table);
+    size_t nobfel /*number_of_bits_for_entry_len*/ = 0;
+    while (((size_t)1<<nobfel) <= maximum_entry_len) {
+        nobfel+=1;
+    }
+    return nobfel;
+}
+
+// Only code lengths are sent, the codes are canonical. Symbols are sent as
+// gaps from the previous symbol, which stays small however large the alphabet.
+bool write_huffman_table(HuffmanTable* table, BitWriter writer) {
+    size_t nobfel = huffman_table_nobfel(table);
+    //printf("nobfel %zu\nentry count: %zu\n", nobfel, table->symbol_count);
+    bool ok = write_byte(writer, nobfel);
+    ok &= write_bits(writer, table->symbol_count, 17);
+    uint32_t previous = 0;
+    for (size_t i = 0; i < table->symbol_count; i++) {
+        uint16_t symbol = table->symbols[i];
+        ok &= write_gamma(writer, (uint32_t)symbol + 1 - previous);
+        ok &= write_bits(writer, table->entries[symbol].len, nobfel);
+        previous = (uint32_t)symbol + 1;
+    }
+    return ok;
+}
+
+bool read_huffman_table_header(HuffmanTable* table, BitReader reader, size_t alphabet_size, size_t* nobfel, size_t* entry_count) {
+    huffman_table_clear(table, alphabet_size);
+    unsigned char nobfel_byte = 0;
+    if (!read_byte(reader, &nobfel_byte)) return false;
+    //printf("number of bits per entry len %d\n", nobfel_byte);
+    uint64_t count = 0;
+    if (!read_bits(reader, 17, &count)) return false;
+    //printf("entry count %zu\n", count);
+    if (count > alphabet_size || nobfel_byte > 8) return false;
+    *nobfel = nobfel_byte;
+    *entry_count = count;
+    return true;
+}
+
+// Adds nothing to the table unless the whole entry could be read
+bool read_huffman_table_entry(HuffmanTable* table, BitReader reader, size_t nobfel, uint32_t* previous) {
+    uint32_t gap = 0;
+    uint64_t length = 0;
+    if (!read_gamma(reader, &gap)) return false;
+    if (!read_bits(reader, nobfel, &length)) return false;
+    uint32_t symbol = *previous + gap - 1;
+    if (symbol >= table->alphabet_size) return false;
+    //printf("Reading symbol %u len %zu\n", symbol, length);
+    table->symbols[table->symbol_count++] = symbol;
+    table->entries[symbol] = (HuffmanTableEntry){.len = length};
+    *previous = symbol + 1;
+    return true;
+}
+
+bool read_huffman_table(HuffmanTable* table, BitReader reader, size_t alphabet_size) {
+    size_t nobfel = 0;
+    size_t entry_count = 0;
+    if (!read_huffman_table_header(table, reader, alphabet_size, &nobfel, &entry_count)) return false;
+    uint32_t previous = 0;
+    for (size_t entry_it = 0; entry_it < entry_count; entry_it++) {
+        if (!read_huffman_table_entry(table, reader, nobfel, &previous)) return false;
+    }
+    return huffman_table_assign_codes(table);
+}
+
+void huffman_decode_table_build(HuffmanDecodeTable* decode_table, HuffmanTable* table) {
+    memset(decode_table->count, 0, sizeof(decode_table->count));
+    memset(decode_table->lookup, 0, sizeof(decode_table->lookup));
+    decode_table->max_len = 0;
+    decode_table->legacy_tree = 0;
+    for (size_t i = 0; i < table->symbol_count; i++) {
+        size_t len = table->entries[table->symbols[i]].len;
+        decode_table->count[len] += 1;
+        if (len > decode_table->max_len) decode_table->max_len = len;
+    }
+    uint32_t offset = 0;
+    uint64_t code = 0;
+    for (size_t len = 1; len <= HUFFMAN_MAX_CODE_LEN; len++) {
+        code = (code + decode_table->count[len-1]) << 1;
+        decode_table->first_code[len] = (uint32_t)code;
+        decode_table->offset[len] = offset;
+        offset += decode_table->count[len];
+    }
+    // Symbols are listed in ascending order, so they land canonically within each length
+    uint32_t next[HUFFMAN_MAX_CODE_LEN+1];
+    memcpy(next, decode_table->offset, sizeof(next));
+    for (size_t i = 0; i < table->symbol_count; i++) {
+        uint16_t symbol = table->symbols[i];
+        HuffmanTableEntry* entry = &table->entries[symbol];
+        decode_table->symbols[next[entry->len]++] = symbol;
+        if (entry->len > HUFFMAN_LOOKUP_BITS) continue;
+        size_t shift = HUFFMAN_LOOKUP_BITS - entry->len;
+        for (size_t fill = 0; fill < ((size_t)1 << shift); fill++) {
+            decode_table->lookup[((size_t)entry->code << shift) | fill] = (HuffmanLookupEntry){
+                .symbol = symbol,
+                .len = entry->len,
+            };
         }
-        else {
-            return read_encoded_message_byte(root->right, reader);
+    }
+}
+
+// FNV-1a over what the serialized table holds, the symbols and their code lengths
+uint64_t huffman_table_fingerprint(HuffmanTable* table) {
+    uint64_t hash = 0xcbf29ce484222325ull ^ table->symbol_count;
+    for (size_t i = 0; i < table->symbol_count; i++) {
+        uint16_t symbol = table->symbols[i];
+        uint32_t value = ((uint32_t)symbol << 8) | table->entries[symbol].len;
+        for (size_t byte = 0; byte < 3; byte++) {
+            hash = (hash ^ ((value >> (8*byte)) & 0xFF)) * 0x100000001b3ull;
         }
     }
+    return hash;
 }
 
-void write_huffman_table(HuffmanTable* table, BitWriter writer) {
-    size_t maximum_entry_len = 0;
-    size_t entry_count = 0;
-    for (size_t i = 0; i < 256; i++) {
-        HuffmanTableEntry* entry = &table->entries[i];
-        if (entry->len) entry_count += 1;
-        if (entry->len > maximum_entry_len) {
-            maximum_entry_len = entry->len;
+// A matching fingerprint is only trusted once the decode table is checked to
+// hold exactly the symbols and code lengths of table
+bool huffman_decode_table_matches(HuffmanDecodeTable* decode_table, HuffmanTable* table) {
+    uint32_t count[HUFFMAN_MAX_CODE_LEN+1] = {0};
+    for (size_t i = 0; i < table->symbol_count; i++) {
+        count[table->entries[table->symbols[i]].len] += 1;
+    }
+    if (memcmp(count, decode_table->count, sizeof(count)) != 0) return false;
+    uint32_t next[HUFFMAN_MAX_CODE_LEN+1];
+    memcpy(next, decode_table->offset, sizeof(next));
+    for (size_t i = 0; i < table->symbol_count; i++) {
+        uint16_t symbol = table->symbols[i];
+        if (decode_table->symbols[next[table->entries[symbol].len]++] != symbol) return false;
+    }
+    return true;
+}
+
+void huffman_ans_table_init(Arena* arena, HuffmanAnsTable* table, size_t capacity) {
+    *table = (HuffmanAnsTable){
+        .symbols = arena_new(arena, uint16_t, capacity),
+        .counts = arena_new(arena, uint16_t, capacity),
+    };
+}
+
+size_t huffman_ans_table_bytes(size_t capacity) {
+    return capacity*2*sizeof(uint16_t);
+}
+
+void huffman_ans_table_grow(Arena* arena, HuffmanAnsTable* table, size_t old_capacity, size_t capacity) {
+    HuffmanAnsTable grown = {0};
+    huffman_ans_table_init(arena, &grown, capacity);
+    if (old_capacity) {
+        memcpy(grown.symbols, table->symbols, old_capacity*sizeof(uint16_t));
+        memcpy(grown.counts, table->counts, old_capacity*sizeof(uint16_t));
+    }
+    grown.alphabet_size = table->alphabet_size;
+    grown.symbol_count = table->symbol_count;
+    *table = grown;
+}
+
+void huffman_ans_table_clear(HuffmanAnsTable* table, size_t alphabet_size) {
+    for (size_t i = 0; i < table->symbol_count; i++) {
+        table->counts[table->symbols[i]] = 0;
+    }
+    table->symbol_count = 0;
+    table->alphabet_size = alphabet_size;
+}
+
+uint32_t huffman_floor_log2(uint32_t value) {
+    uint32_t log = 0;
+    while ((value >> log) > 1) log += 1;
+    return log;
+}
+
+// log2(value) in 1/256 bits, by repeated squaring of the mantissa
+uint32_t huffman_log2_q8(uint32_t value) {
+    assert(value > 0);
+    uint32_t integer = huffman_floor_log2(value);
+    uint64_t mantissa = ((uint64_t)value << 16) >> integer; // In [1, 2) as 16.16
+    uint32_t fraction = 0;
+    for (size_t i = 0; i < 8; i++) {
+        mantissa = (mantissa * mantissa) >> 16;
+        fraction <<= 1;
+        if (mantissa >= ((uint64_t)2 << 16)) {
+            mantissa >>= 1;
+            fraction |= 1;
         }
     }
-    size_t nobfel /*number_of_bits_for_entry_len*/ = 0;
-    while ((1<<nobfel) <= maximum_entry_len) {
-        nobfel+=1;
+    return (integer << 8) | fraction;
+}
+
+// Scales the histogram to counts that sum to HUFFMAN_ANS_STATES, every symbol
+// that occurs keeps at least one state. False if the block suits Huffman better.
+bool huffman_ans_table_from_histogram(HuffmanHistogram* histogram, HuffmanAnsTable* table) {
+    huffman_ans_table_clear(table, histogram->alphabet_size);
+    if (histogram->symbol_count == 0 || histogram->symbol_count > HUFFMAN_ANS_MAX_SYMBOLS) return false;
+    int64_t total = 0;
+    for (size_t i = 0; i < histogram->symbol_count; i++) {
+        total += histogram->frequencies[histogram->symbols[i]];
     }
-    
-    //printf("nobfel %zu\nentry count: %zu\n", nobfel, entry_count);
-    write_byte(writer, nobfel);
-    write_byte(writer, entry_count);
-    for (size_t i = 0; i < 256; i++) {
-        HuffmanTableEntry* entry = &table->entries[i];
-        if (entry->len) {
-            write_byte(writer, i);
-            //printf("Writing len %zu for %c\n", entry->len, (unsigned char)i);
-            for (size_t i = nobfel-1; i < nobfel; i--) {
-                //printf(".%c. ", (bool)(entry->len & (1 << i)) + '0');
-                writer.write_bit(writer.userdata, entry->len & (1 << i));
-            }
-            //printf("\nWriting data for %c\n", (unsigned char)i);
-            for (size_t i = 0; i < entry->len; i++) {
-                writer.write_bit(writer.userdata, entry->code[i]);
+    int64_t sum = 0;
+    uint16_t largest = histogram->symbols[0];
+    for (size_t i = 0; i < histogram->symbol_count; i++) {
+        uint16_t symbol = histogram->symbols[i];
+        int64_t count = (histogram->frequencies[symbol] * HUFFMAN_ANS_STATES + total/2) / total;
+        if (count < 1) count = 1;
+        table->symbols[i] = symbol;
+        table->counts[symbol] = (uint16_t)count;
+        sum += count;
+        if (count > table->counts[largest]) largest = symbol;
+    }
+    table->symbol_count = histogram->symbol_count;
+    // Rounding and the floor of one leave the sum off, the largest count takes
+    // the difference while that costs it little, else the counts above one give
+    int64_t excess = sum - HUFFMAN_ANS_STATES;
+    if (excess < table->counts[largest] / 2) {
+        table->counts[largest] -= excess;
+        return true;
+    }
+    while (excess > 0) {
+        for (size_t i = 0; i < table->symbol_count && excess > 0; i++) {
+            uint16_t symbol = table->symbols[i];
+            if (table->counts[symbol] > 1) {
+                table->counts[symbol] -= 1;
+                excess -= 1;
             }
-            //printf("\n");
         }
     }
+    return true;
+}
+
+// Same layout as the Huffman table, with the counts gamma coded in place of lengths
+size_t huffman_ans_header_bits(HuffmanAnsTable* table) {
+    size_t bits = 8 + 17;
+    uint32_t previous = 0;
+    for (size_t i = 0; i < table->symbol_count; i++) {
+        uint16_t symbol = table->symbols[i];
+        bits += huffman_gamma_bits((uint32_t)symbol + 1 - previous) + huffman_gamma_bits(table->counts[symbol]);
+        previous = (uint32_t)symbol + 1;
+    }
+    return bits;
+}
+
+// Payload estimate from the ideal cost of each count, tANS stays within a
+// fraction of a percent of it
+uint64_t huffman_ans_payload_bits(HuffmanAnsTable* table, HuffmanHistogram* histogram) {
+    uint64_t cost = 0;
+    for (size_t i = 0; i < histogram->symbol_count; i++) {
+        uint16_t symbol = histogram->symbols[i];
+        uint32_t bits_q8 = (HUFFMAN_ANS_TABLE_LOG << 8) - huffman_log2_q8(table->counts[symbol]);
+        cost += (uint64_t)histogram->frequencies[symbol] * bits_q8;
+    }
+    // The final states are sent too
+    return (cost >> 8) + 2*HUFFMAN_ANS_TABLE_LOG;
+}
+
+bool write_ans_table(HuffmanAnsTable* table, BitWriter writer) {
+    bool ok = write_byte(writer, HUFFMAN_ANS_TABLE_LOG);
+    ok &= write_bits(writer, table->symbol_count, 17);
+    uint32_t previous = 0;
+    for (size_t i = 0; i < table->symbol_count; i++) {
+        uint16_t symbol = table->symbols[i];
+        ok &= write_gamma(writer, (uint32_t)symbol + 1 - previous);
+        ok &= write_gamma(writer, table->counts[symbol]);
+        previous = (uint32_t)symbol + 1;
+    }
+    return ok;
+}
+
+bool read_ans_table_header(HuffmanAnsTable* table, BitReader reader, size_t alphabet_size, size_t* entry_count) {
+    huffman_ans_table_clear(table, alphabet_size);
+    unsigned char table_log = 0;
+    if (!read_byte(reader, &table_log)) return false;
+    uint64_t count = 0;
+    if (!read_bits(reader, 17, &count)) return false;
+    if (table_log != HUFFMAN_ANS_TABLE_LOG || count == 0 || count > HUFFMAN_ANS_STATES || count > alphabet_size) return false;
+    *entry_count = count;
+    return true;
+}
+
+// Adds nothing to the table unless the whole entry could be read
+bool read_ans_table_entry(HuffmanAnsTable* table, BitReader reader, uint32_t* previous) {
+    uint32_t gap = 0;
+    uint32_t count = 0;
+    if (!read_gamma(reader, &gap)) return false;
+    if (!read_gamma(reader, &count)) return false;
+    uint32_t symbol = *previous + gap - 1;
+    if (symbol >= table->alphabet_size || count > HUFFMAN_ANS_STATES) return false;
+    table->symbols[table->symbol_count++] = symbol;
+    table->counts[symbol] = count;
+    *previous = symbol + 1;
+    return true;
+}
+
+bool huffman_ans_table_check(HuffmanAnsTable* table) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < table->symbol_count; i++) {
+        sum += table->counts[table->symbols[i]];
+    }
+    return sum == HUFFMAN_ANS_STATES;
 }
 
-void read_huffman_table(HuffmanTable* table, BitReader reader) {
-    unsigned char nobfel = 0;
-    read_byte(reader, &nobfel);
-    //printf("number of bits per entry len %d\n", nobfel);
-    unsigned char entry_count = 0;
-    read_byte(reader, &entry_count);
-    //printf("entry count %d\n", entry_count);
+bool read_ans_table(HuffmanAnsTable* table, BitReader reader, size_t alphabet_size) {
+    size_t entry_count = 0;
+    if (!read_ans_table_header(table, reader, alphabet_size, &entry_count)) return false;
+    uint32_t previous = 0;
     for (size_t entry_it = 0; entry_it < entry_count; entry_it++) {
-        unsigned char symbol = 0;
-        read_byte(reader, &symbol);
-        
-        HuffmanTableEntry* entry = &table->entries[symbol];
-        size_t length = 0;
-        for (size_t biti = 0; biti < nobfel; biti++) {
-            bool bit = 0;
-            reader.read_bit(reader.userdata, &bit);
-            length |= bit << (nobfel-1-biti);
-            //printf("Reading %zu bit .%c.\n", length, bit + '0');
-        }
-        //printf("Reading symbol `%c` len %zu\n", symbol, length);
-        HuffmanTableEntry new_entry = {
-            .len = length,
+        if (!read_ans_table_entry(table, reader, &previous)) return false;
+    }
+    return huffman_ans_table_check(table);
+}
+
+// Scatters the states of each symbol across the table, so that every
+// symbol's states are spread over the whole range
+void huffman_ans_spread(HuffmanAnsTable* table, uint16_t* slots) {
+    size_t step = (HUFFMAN_ANS_STATES >> 1) + (HUFFMAN_ANS_STATES >> 3) + 3;
+    size_t position = 0;
+    for (size_t i = 0; i < table->symbol_count; i++) {
+        uint16_t symbol = table->symbols[i];
+        for (size_t k = 0; k < table->counts[symbol]; k++) {
+            slots[position] = symbol;
+            position = (position + step) & (HUFFMAN_ANS_STATES - 1);
+        }
+    }
+}
+
+// The state x of a symbol sheds bits down to [count, 2*count) and moves to the
+// (x - count)-th slot of the symbol, in slot order
+void huffman_ans_encode_table_build(Arena scratch, HuffmanAnsTable* table, HuffmanAnsTransform* transforms, uint16_t* states) {
+    uint16_t* slots = arena_new(&scratch, uint16_t, HUFFMAN_ANS_STATES);
+    uint32_t* next = arena_new(&scratch, uint32_t, table->alphabet_size);
+    huffman_ans_spread(table, slots);
+    uint32_t start = 0;
+    for (size_t i = 0; i < table->symbol_count; i++) {
+        uint16_t symbol = table->symbols[i];
+        uint32_t count = table->counts[symbol];
+        uint32_t max_bits = HUFFMAN_ANS_TABLE_LOG - huffman_floor_log2(count);
+        transforms[symbol] = (HuffmanAnsTransform){
+            .delta_bits = (int32_t)(max_bits << 16) - (int32_t)(count << max_bits),
+            .delta_state = (int32_t)start - (int32_t)count,
+        };
+        next[symbol] = start;
+        start += count;
+    }
+    for (uint32_t slot = 0; slot < HUFFMAN_ANS_STATES; slot++) {
+        states[next[slots[slot]]++] = (uint16_t)(HUFFMAN_ANS_STATES + slot);
+    }
+}
+
+void huffman_ans_decode_table_build(Arena scratch, HuffmanAnsDecodeTable* decode_table, HuffmanAnsTable* table) {
+    uint16_t* slots = arena_new(&scratch, uint16_t, HUFFMAN_ANS_STATES);
+    uint32_t* next = arena_new(&scratch, uint32_t, table->alphabet_size);
+    huffman_ans_spread(table, slots);
+    for (size_t i = 0; i < table->symbol_count; i++) {
+        next[table->symbols[i]] = table->counts[table->symbols[i]];
+    }
+    for (uint32_t slot = 0; slot < HUFFMAN_ANS_STATES; slot++) {
+        uint16_t symbol = slots[slot];
+        uint32_t state = next[symbol]++;
+        uint32_t bit_count = HUFFMAN_ANS_TABLE_LOG - huffman_floor_log2(state);
+        decode_table->entries[slot] = (HuffmanAnsDecodeEntry){
+            .symbol = symbol,
+            .base = (uint16_t)((state << bit_count) - HUFFMAN_ANS_STATES),
+            .bit_count = (uint8_t)bit_count,
         };
-        for (size_t i = 0; i < length; i++) {
-            bool bit = 0;
-            reader.read_bit(reader.userdata, &bit);
-            new_entry.code[i] = bit;
+    }
+}
+
+// The decoder's two first states are sent before the symbols' bits
+bool write_ans_block(Arena scratch, HuffmanAnsTable* table, unsigned char flags, BitWriter writer, const unsigned char* msg, size_t symbol_count, size_t symbol_size) {
+    flags |= HUFFMAN_BLOCK_ANS;
+    if (symbol_size == 2) flags |= HUFFMAN_BLOCK_WIDE_SYMBOLS;
+    bool ok = write_byte(writer, flags);
+    ok &= write_ans_table(table, writer);
+    ok &= write_encoded_message_length(writer, symbol_count);
+    HuffmanAnsTransform* transforms = arena_new(&scratch, HuffmanAnsTransform, table->alphabet_size);
+    uint16_t* states = arena_new(&scratch, uint16_t, HUFFMAN_ANS_STATES);
+    uint32_t* chunks = arena_new(&scratch, uint32_t, symbol_count);
+    huffman_ans_encode_table_build(scratch, table, transforms, states);
+    const HuffmanKernels* kernels = huffman_kernels();
+    uint32_t first_states[2] = {0};
+    kernels->ans_encode(transforms, states, msg, symbol_count, symbol_size, chunks, first_states);
+    ok &= write_bits(writer, first_states[0] - HUFFMAN_ANS_STATES, HUFFMAN_ANS_TABLE_LOG);
+    ok &= write_bits(writer, first_states[1] - HUFFMAN_ANS_STATES, HUFFMAN_ANS_TABLE_LOG);
+    if (writer.write_bit == memory_write_bit) {
+        ok = ok && kernels->pack(chunks, symbol_count, writer.userdata);
+    }
+    else {
+        for (size_t i = 0; i < symbol_count; i++) {
+            ok &= write_bits(writer, chunks[i] >> 8, chunks[i] & 0xFF);
         }
-        *entry = new_entry;
     }
+    if (flags & HUFFMAN_BLOCK_TRAILING_BYTE) ok &= write_byte(writer, msg[symbol_count*symbol_size]);
+    return ok;
 }
 
 void printtree(Node* root, size_t indent) {
     if (root == 0) return;
     for (size_t i = 0; i < indent; i++) putchar(' ');
-    printf("%c (%lld)\n", root->symbol, root->freq);
-     
+    printf("%u\n", root->symbol);
+
     printtree(root->left, indent+1);
     printtree(root->right,indent+1);
 }
 
 Node* huffmantree_from_table(Arena* arena, HuffmanTable* table) {
     Node* root = arena_new(arena, Node, 1);
-    for (size_t i = 0; i < 256; i++) {
-        HuffmanTableEntry* entry = &table->entries[i];
-        if (entry->len) {
-            Node* node = root;
-            for (size_t i = 0; i < entry->len; i++) {
-                if (entry->code[i] == true) {
-                    if (!node->left) node->left = arena_new(arena, Node, 1);
-                    node = node->left;
-                }
-                else {
-                    if (!node->right) node->right = arena_new(arena, Node, 1);
-                    node = node->right;
-                }
+    for (size_t i = 0; i < table->symbol_count; i++) {
+        uint16_t symbol = table->symbols[i];
+        HuffmanTableEntry* entry = &table->entries[symbol];
+        Node* node = root;
+        for (size_t i = entry->len-1; i < entry->len; i--) {
+            if ((entry->code >> i) & 1) {
+                if (!node->left) node->left = arena_new(arena, Node, 1);
+                node = node->left;
+            }
+            else {
+                if (!node->right) node->right = arena_new(arena, Node, 1);
+                node = node->right;
             }
-            node->symbol = i;
         }
+        node->symbol = symbol;
     }
     return root;
 }
 
-void huffman_table_from_tree(Node* root, HuffmanTable* huffman_table, unsigned char* code, size_t entry_len) {
-    if (!root) return;
-    if (root->left) {
-        code[entry_len] = true;
-        huffman_table_from_tree(root->left, huffman_table, code, entry_len+1);
+bool read_legacy_table(HuffmanLegacyTree* tree, BitReader reader, size_t nobfel) {
+    unsigned char count_byte = 0;
+    if (nobfel > 8 || !read_byte(reader, &count_byte)) return false;
+    size_t entry_count = count_byte == 0 && nobfel > 0 ? 256 : count_byte;
+    tree->nodes[0] = (HuffmanLegacyNode){.symbol = -1};
+    tree->node_count = 1;
+    for (size_t entry = 0; entry < entry_count; entry++) {
+        unsigned char symbol = 0;
+        uint64_t len = 0;
+        if (!read_byte(reader, &symbol) || !read_bits(reader, nobfel, &len) || len == 0) return false;
+        size_t node = 0;
+        for (size_t i = 0; i < len; i++) {
+            bool bit = false;
+            if (!reader.read_bit(reader.userdata, &bit)) return false;
+            // No code may continue past the end of another
+            if (tree->nodes[node].symbol >= 0) return false;
+            uint16_t* child = &tree->nodes[node].child[bit];
+            if (!*child) {
+                if (tree->node_count == HUFFMAN_LEGACY_MAX_NODES) return false;
+                *child = (uint16_t)tree->node_count;
+                tree->nodes[tree->node_count++] = (HuffmanLegacyNode){.symbol = -1};
+            }
+            node = *child;
+        }
+        HuffmanLegacyNode* leaf = &tree->nodes[node];
+        if (leaf->symbol >= 0 || leaf->child[0] || leaf->child[1]) return false;
+        leaf->symbol = symbol;
+    }
+    return true;
+}
+
+// Decode table for the kernels from a legacy tree, whose codes are not
+// canonical. False if a code is too long for them, the tree is walked then.
+bool huffman_legacy_decode_table_build(HuffmanDecodeTable* decode_table, const HuffmanLegacyTree* tree) {
+    memset(decode_table->count, 0, sizeof(decode_table->count));
+    memset(decode_table->lookup, 0, sizeof(decode_table->lookup));
+    decode_table->max_len = 0;
+    decode_table->legacy_tree = 0;
+    // Depth first from the root, with the code that leads to each node, cut
+    // to the lookup's bits
+    typedef struct {
+        uint16_t node;
+        uint32_t code;
+        uint32_t len;
+    } HuffmanLegacyPath;
+    HuffmanLegacyPath stack[HUFFMAN_LEGACY_MAX_NODES];
+    size_t stack_len = 0;
+    if (tree->node_count > 1) stack[stack_len++] = (HuffmanLegacyPath){0};
+    uint16_t leaves[256];
+    uint8_t leaf_lens[256];
+    size_t leaf_count = 0;
+    while (stack_len > 0) {
+        uint16_t node = stack[stack_len-1].node;
+        uint32_t code = stack[stack_len-1].code;
+        uint32_t len = stack[stack_len-1].len;
+        stack_len -= 1;
+        const HuffmanLegacyNode* n = &tree->nodes[node];
+        if (len == HUFFMAN_LOOKUP_BITS && n->symbol < 0) {
+            decode_table->lookup[code] = (HuffmanLookupEntry){.symbol = node};
+        }
+        if (n->symbol >= 0) {
+            if (len > HUFFMAN_MAX_CODE_LEN) return false;
+            leaves[leaf_count] = (uint16_t)n->symbol;
+            leaf_lens[leaf_count++] = (uint8_t)len;
+            decode_table->count[len] += 1;
+            if (len > decode_table->max_len) decode_table->max_len = len;
+            if (len > HUFFMAN_LOOKUP_BITS) continue;
+            size_t shift = HUFFMAN_LOOKUP_BITS - len;
+            for (size_t fill = 0; fill < ((size_t)1 << shift); fill++) {
+                decode_table->lookup[((size_t)code << shift) | fill] = (HuffmanLookupEntry){
+                    .symbol = (uint16_t)n->symbol,
+                    .len = (uint16_t)len,
+                };
+            }
+            continue;
+        }
+        if (len == HUFFMAN_MAX_CODE_LEN) return false;
+        for (size_t bit = 0; bit < 2; bit++) {
+            if (!n->child[bit]) continue;
+            stack[stack_len++] = (HuffmanLegacyPath){
+                .node = n->child[bit],
+                .code = len < HUFFMAN_LOOKUP_BITS ? (code << 1) | (uint32_t)bit : code,
+                .len = len + 1,
+            };
+        }
     }
-    if (root->right) {
-        code[entry_len] = false;
-        huffman_table_from_tree(root->right, huffman_table, code, entry_len+1);
+    uint32_t offset = 0;
+    for (size_t len = 1; len <= HUFFMAN_MAX_CODE_LEN; len++) {
+        decode_table->offset[len] = offset;
+        offset += decode_table->count[len];
     }
-    if (root->symbol) {
-        HuffmanTableEntry entry = {.len=entry_len};
-        memcpy(entry.code, code, entry_len);
-        huffman_table->entries[root->symbol] = entry;
+    uint32_t next[HUFFMAN_MAX_CODE_LEN+1];
+    memcpy(next, decode_table->offset, sizeof(next));
+    for (size_t i = 0; i < leaf_count; i++) {
+        decode_table->symbols[next[leaf_lens[i]]++] = leaves[i];
     }
+    decode_table->legacy_tree = tree;
+    return true;
 }
 
-[[nodiscard]] bool huffman_write(Arena arena, BitWriter writer, char* msg_in, size_t msg_len) {
-    unsigned char* msg = (unsigned char*)msg_in;
-    int64_t frequencies[256] = {0};
-    for (size_t i = 0; i < msg_len; i++) {
-        frequencies[(unsigned char)msg[i]] += 1;
+bool read_legacy_symbol(HuffmanLegacyTree* tree, BitReader reader, unsigned char* symbol) {
+    size_t node = 0;
+    while (tree->nodes[node].symbol < 0) {
+        bool bit = false;
+        if (!reader.read_bit(reader.userdata, &bit)) return false;
+        node = tree->nodes[node].child[bit];
+        // Codes the table left unused
+        if (!node) return false;
     }
-    
-    Node nodes[256] = {0};
-    HeapQueue heapq = {
-        .arena = &arena,
-        .cmp_cb = cmp_nodes,
-        .elem_size = sizeof(Node),
-    };
-    for (size_t i = 0; i < 256; i++) {
-        nodes[i] = (Node){.freq = frequencies[i], .symbol = i};
-        if (nodes[i].freq) {
-            hq_push(&heapq, &nodes[i]);
-        }
-    }
-    Node* nodes2 = (Node*)heapq.data;
-    while (heapq.len > 1) {
-        Node* node1 = (Node*)hq_pop(&heapq);
-        Node* node2 = (Node*)hq_pop(&heapq);
-        Node new_node = (Node){
-            .freq = node1->freq + node2->freq,
-            .symbol = '\0',
-            .left = arena_dup(&arena, node1, sizeof(Node)),
-            .right = arena_dup(&arena, node2, sizeof(Node)),
-        };
-        hq_push(&heapq, &new_node);
-    }
-    Node* root = (Node*)hq_pop(&heapq);
-    HuffmanTable huffman_table = {0};
-    unsigned char code[256];
-    huffman_table_from_tree(root, &huffman_table, code, 0);
-    
-    write_huffman_table(&huffman_table, writer);
-    write_encoded_message(&huffman_table, writer, msg, msg_len);
-    write_byte(writer, 0xFF);
-    writer.flush(writer.userdata);
+    *symbol = (unsigned char)tree->nodes[node].symbol;
     return true;
 }
 
-char* huffman_read(Arena* arena, BitReader reader, size_t* len, bool* ok) {
-    HuffmanTable read_table = {0};
-    read_huffman_table(&read_table, reader);
-    //print_huffman_table(&read_table);
-    size_t length = read_encoded_message_length(reader);
-    char* buffer = arena_new(arena, char, length);
-    {
-        Arena scratch = *arena;
-        Node* rroot = huffmantree_from_table(&scratch, &read_table);
-        //printtree(rroot, 0);
-        for (size_t i = 0; i < length; i++) {
-            buffer[i] = read_encoded_message_byte(rroot, reader);
-        }
-        *len = length;
+void huffman_table_from_histogram(Arena arena, HuffmanHistogram* histogram, size_t max_code_len, HuffmanTable* huffman_table) {
+    huffman_table_clear(huffman_table, histogram->alphabet_size);
+    size_t symbol_count = histogram->symbol_count;
+    if (symbol_count == 0) return;
+    // Leaves are 0..symbol_count-1, merged nodes are numbered in creation order
+    HuffmanLeaf* leaves = arena_new(&arena, HuffmanLeaf, symbol_count);
+    int64_t* merged_freqs = arena_new(&arena, int64_t, symbol_count);
+    uint32_t* parents = arena_new(&arena, uint32_t, 2*symbol_count);
+    uint32_t* depths = arena_new(&arena, uint32_t, 2*symbol_count);
+    for (size_t i = 0; i < symbol_count; i++) {
+        leaves[i] = (HuffmanLeaf){.freq = histogram->frequencies[histogram->symbols[i]], .node = i};
+    }
+    while (true) {
+        // Merged nodes come out in order of frequency when the leaves go in
+        // sorted, so the two smallest nodes are always at the front of the
+        // sorted leaves or of the merged nodes
+        qsort(leaves, symbol_count, sizeof(HuffmanLeaf), huffman_compare_leaves);
+        size_t next_leaf = 0;
+        uint32_t next_merged = symbol_count;
+        uint32_t next_node = symbol_count;
+        while (next_node < 2*symbol_count - 1) {
+            int64_t freq = 0;
+            for (size_t child = 0; child < 2; child++) {
+                bool take_leaf = next_leaf < symbol_count
+                    && (next_merged == next_node || leaves[next_leaf].freq < merged_freqs[next_merged - symbol_count]);
+                uint32_t node = take_leaf ? leaves[next_leaf].node : next_merged;
+                freq += take_leaf ? leaves[next_leaf++].freq : merged_freqs[next_merged++ - symbol_count];
+                parents[node] = next_node;
+            }
+            merged_freqs[next_node++ - symbol_count] = freq;
+        }
+        // Parents are numbered after their children, walk down from the root
+        size_t max_len = 0;
+        depths[next_node-1] = 0;
+        for (size_t node = next_node-1; node-- > 0;) {
+            depths[node] = depths[parents[node]] + 1;
+            if (node < symbol_count && depths[node] > max_len) max_len = depths[node];
+        }
+        if (max_len <= max_code_len) break;
+        // Flatten the distribution until the tree is shallow enough,
+        // all ones yields a balanced tree so this terminates for sane limits
+        for (size_t i = 0; i < symbol_count; i++) {
+            leaves[i].freq = (leaves[i].freq + 1) / 2;
+        }
+    }
+    for (size_t i = 0; i < symbol_count; i++) {
+        uint16_t symbol = histogram->symbols[i];
+        huffman_table->symbols[i] = symbol;
+        // A lone symbol still needs a one bit code
+        huffman_table->entries[symbol].len = symbol_count == 1 ? 1 : depths[i];
     }
+    huffman_table->symbol_count = symbol_count;
+    huffman_table_assign_codes(huffman_table);
+}
+
+size_t huffman_table_header_bits(HuffmanTable* table) {
+    size_t nobfel = huffman_table_nobfel(table);
+    size_t bits = 8 + 17;
+    uint32_t previous = 0;
+    for (size_t i = 0; i < table->symbol_count; i++) {
+        uint16_t symbol = table->symbols[i];
+        bits += huffman_gamma_bits((uint32_t)symbol + 1 - previous) + nobfel;
+        previous = (uint32_t)symbol + 1;
+    }
+    return bits;
+}
+
+// Returns UINT64_MAX if the table has no code for a symbol that occurs
+uint64_t huffman_payload_bits(HuffmanTable* table, HuffmanHistogram* histogram) {
+    if (table->alphabet_size != histogram->alphabet_size) return UINT64_MAX;
+    uint64_t bits = 0;
+    for (size_t i = 0; i < histogram->symbol_count; i++) {
+        uint16_t symbol = histogram->symbols[i];
+        if (!table->entries[symbol].len) return UINT64_MAX;
+        bits += (uint64_t)histogram->frequencies[symbol] * table->entries[symbol].len;
+    }
+    return bits;
+}
+
+// The entropy of the histogram in bits, no prefix code takes fewer
+uint64_t huffman_entropy_bits(HuffmanHistogram* histogram) {
+    int64_t total = 0;
+    for (size_t i = 0; i < histogram->symbol_count; i++) {
+        total += histogram->frequencies[histogram->symbols[i]];
+    }
+    if (total == 0 || total > UINT32_MAX) return 0;
+    uint32_t total_log2 = huffman_log2_q8((uint32_t)total);
+    uint64_t bits_q8 = 0;
+    for (size_t i = 0; i < histogram->symbol_count; i++) {
+        int64_t frequency = histogram->frequencies[histogram->symbols[i]];
+        bits_q8 += (uint64_t)frequency * (total_log2 - huffman_log2_q8((uint32_t)frequency));
+    }
+    return bits_q8 >> 8;
+}
+
+// The cost of the block as tANS, UINT64_MAX unless that is HUFFMAN_ANS_MARGIN
+// below huffman_cost. tANS codes no better than the entropy, so the table is
+// only built when Huffman is far enough above it, which keeps the fast levels fast.
+uint64_t huffman_ans_cost(HuffmanHistogram* histogram, HuffmanAnsTable* table, uint64_t huffman_cost, size_t sample_step) {
+    if (huffman_entropy_bits(histogram)*1000 >= huffman_cost*(1000 - HUFFMAN_ANS_MARGIN)) return UINT64_MAX;
+    if (!huffman_ans_table_from_histogram(histogram, table)) return UINT64_MAX;
+    uint64_t cost = huffman_ans_payload_bits(table, histogram) + huffman_ans_header_bits(table) / sample_step;
+    return cost*1000 < huffman_cost*(1000 - HUFFMAN_ANS_MARGIN) ? cost : UINT64_MAX;
+}
+
+void huffman_histogram(const unsigned char* msg, size_t symbol_count, size_t symbol_size, size_t sample_step, HuffmanHistogram* histogram) {
+    huffman_histogram_clear(histogram, huffman_alphabet_size(symbol_size));
+    int64_t* frequencies = histogram->frequencies;
+    if (sample_step <= 1 || symbol_size > 1) {
+        // Sampling would have to assume every symbol of a large alphabet occurs,
+        // whose table costs more than the exact count saves
+        huffman_kernels()->histogram(msg, symbol_count, symbol_size, histogram);
+        huffman_histogram_sort(histogram);
+    }
+    else {
+        for (size_t i = 0; i < symbol_count; i += sample_step) {
+            frequencies[msg[i]] += 1;
+        }
+        // Unsampled symbols may still occur, keep every byte codable
+        for (size_t i = 0; i < 256; i++) {
+            frequencies[i] += 1;
+        }
+        huffman_histogram_collect(histogram);
+    }
+}
+
+// Picks the code length limit with the smallest block, returns its cost in bits
+uint64_t huffman_best_table(Arena arena, HuffmanHistogram* histogram, HuffmanTable* table) {
+    uint64_t best_cost = UINT64_MAX;
+    HuffmanTable candidate = {0};
+    huffman_table_init(&arena, &candidate, histogram->alphabet_size);
+    for (size_t i = 0; i < sizeof(huffman_code_len_candidates)/sizeof(huffman_code_len_candidates[0]); i++) {
+        size_t limit = huffman_code_len_candidates[i];
+        if (((size_t)1<<limit) < histogram->symbol_count) break;
+        huffman_table_from_histogram(arena, histogram, limit, &candidate);
+        uint64_t cost = huffman_table_header_bits(&candidate) + huffman_payload_bits(&candidate, histogram);
+        if (cost < best_cost) {
+            best_cost = cost;
+            huffman_table_copy(table, &candidate);
+        }
+    }
+    return best_cost;
+}
+
+// Blocks are priced the way huffman_encoder_write_region codes them, with the
+// cheaper of the best Huffman table and tANS
+uint64_t huffman_plan_cost(Arena arena, HuffmanHistogram* histogram, HuffmanTable* table) {
+    uint64_t cost = huffman_best_table(arena, histogram, table);
+    HuffmanAnsTable ans_table = {0};
+    huffman_ans_table_init(&arena, &ans_table, histogram->alphabet_size);
+    uint64_t ans_cost = huffman_ans_cost(histogram, &ans_table, cost, 1);
+    return ans_cost < cost ? ans_cost : cost;
+}
+
+// Splits [msg, msg+symbol_count) in halves while the halves code smaller than the whole
+uint64_t huffman_plan_blocks(Arena arena, const unsigned char* msg, size_t symbol_count, size_t symbol_size, size_t min_split_size, HuffmanHistogram* histogram, size_t* block_sizes, size_t* block_count) {
+    size_t alphabet_size = huffman_alphabet_size(symbol_size);
+    HuffmanTable table = {0};
+    huffman_table_init(&arena, &table, alphabet_size);
+    size_t block_overhead = 8 + 32;
+    if (symbol_count < 2*min_split_size) {
+        huffman_histogram(msg, symbol_count, symbol_size, 1, histogram);
+        block_sizes[(*block_count)++] = symbol_count;
+        return block_overhead + huffman_plan_cost(arena, histogram, &table);
+    }
+    size_t half = symbol_count / 2;
+    HuffmanHistogram right = {0};
+    huffman_histogram_init(&arena, &right, alphabet_size);
+    size_t first = *block_count;
+    uint64_t split_cost = huffman_plan_blocks(arena, msg, half, symbol_size, min_split_size, histogram, block_sizes, block_count);
+    split_cost += huffman_plan_blocks(arena, msg + half*symbol_size, symbol_count - half, symbol_size, min_split_size, &right, block_sizes, block_count);
+    for (size_t i = 0; i < right.symbol_count; i++) {
+        uint16_t symbol = right.symbols[i];
+        if (!histogram->frequencies[symbol]) histogram->symbols[histogram->symbol_count++] = symbol;
+        histogram->frequencies[symbol] += right.frequencies[symbol];
+    }
+    huffman_histogram_sort(histogram);
+    uint64_t whole_cost = block_overhead + huffman_plan_cost(arena, histogram, &table);
+    if (whole_cost <= split_cost) {
+        *block_count = first;
+        block_sizes[(*block_count)++] = symbol_count;
+        return whole_cost;
+    }
+    return split_cost;
+}
+
+// With HUFFMAN_BLOCK_TRAILING_BYTE the byte right after the symbols is stored raw
+bool write_block(HuffmanTable* table, unsigned char flags, BitWriter writer, const unsigned char* msg, size_t symbol_count, size_t symbol_size) {
+    if (symbol_size == 2) flags |= HUFFMAN_BLOCK_WIDE_SYMBOLS;
+    bool ok = write_byte(writer, flags);
+    if (!(flags & (HUFFMAN_BLOCK_REUSE_TABLE | HUFFMAN_BLOCK_ADAPTIVE_TABLE))) ok &= write_huffman_table(table, writer);
+    ok &= write_encoded_message(table, writer, msg, symbol_count, symbol_size);
+    if (flags & HUFFMAN_BLOCK_TRAILING_BYTE) ok &= write_byte(writer, msg[symbol_count*symbol_size]);
+    return ok;
+}
+
+bool write_frame_header(BitWriter writer) {
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(huffman_frame_magic); i++) {
+        ok &= write_byte(writer, huffman_frame_magic[i]);
+    }
+    return ok && write_byte(writer, HUFFMAN_FORMAT_VERSION);
+}
+
+// The end marker, padded to a byte so the next frame can follow directly
+bool write_frame_end(BitWriter writer) {
+    return write_byte(writer, 0xFF) && writer.flush(writer.userdata);
+}
+
+// Input is coded a block at a time, the push encoder's blocks are capped so a
+// context per connection stays small
+#define HUFFMAN_PUSH_BLOCK_SIZE (1<<16)
+
+typedef struct HuffmanPushEncoder {
+    unsigned char* input; // Input of the block being collected
+    size_t input_len;
+    size_t block_size; // In bytes
+    unsigned char* output; // Coded bytes not yet handed out, written through encoder->bits
+    size_t output_capacity;
+    size_t output_offset;
+    bool started; // A message is being pushed, cleared by huffman_encoder_reset
+    bool finished;
+} HuffmanPushEncoder;
+
+[[nodiscard]] bool huffman_encoder_init(HuffmanEncoder* encoder, ptrdiff_t scratch_size, int level) {
+    if (level < HUFFMAN_LEVEL_FASTEST) level = HUFFMAN_LEVEL_FASTEST;
+    if (level > HUFFMAN_LEVEL_MAX) level = HUFFMAN_LEVEL_MAX;
+    *encoder = (HuffmanEncoder){
+        .scratch = arena_init(scratch_size),
+        .level = level,
+        .symbol_size = 1,
+    };
+    if (!encoder->scratch.memory) return false;
+    size_t struct_bytes = 2*sizeof(HuffmanTable) + 3*sizeof(HuffmanHistogram) + sizeof(HuffmanAnsTable);
+    if (!huffman_arena_has_room(&encoder->scratch, struct_bytes, 6)) {
+        huffman_encoder_deinit(encoder);
+        return false;
+    }
+    encoder->table = arena_new(&encoder->scratch, HuffmanTable, 1);
+    encoder->previous_table = arena_new(&encoder->scratch, HuffmanTable, 1);
+    encoder->histogram = arena_new(&encoder->scratch, HuffmanHistogram, 1);
+    encoder->default_model = arena_new(&encoder->scratch, HuffmanHistogram, 1);
+    encoder->model = arena_new(&encoder->scratch, HuffmanHistogram, 1);
+    encoder->ans_table = arena_new(&encoder->scratch, HuffmanAnsTable, 1);
+    if (!huffman_encoder_set_default_model(encoder, 0, 256)) {
+        huffman_encoder_deinit(encoder);
+        return false;
+    }
+    return true;
+}
+
+// Grows the tables, histograms and models to alphabet_size symbols. The arrays
+// for bytes are left behind in the scratch, which is small next to the new ones.
+bool huffman_encoder_reserve_alphabet(HuffmanEncoder* encoder, size_t alphabet_size) {
+    size_t old_capacity = encoder->alphabet_capacity;
+    if (alphabet_size <= old_capacity) return true;
+    size_t bytes = 2*huffman_table_bytes(alphabet_size)
+        + 3*huffman_histogram_bytes(alphabet_size)
+        + huffman_ans_table_bytes(alphabet_size);
+    if (!huffman_arena_has_room(&encoder->scratch, bytes, 15)) return false;
+    huffman_table_grow(&encoder->scratch, encoder->table, old_capacity, alphabet_size);
+    huffman_table_grow(&encoder->scratch, encoder->previous_table, old_capacity, alphabet_size);
+    huffman_histogram_grow(&encoder->scratch, encoder->histogram, old_capacity, alphabet_size);
+    huffman_histogram_grow(&encoder->scratch, encoder->default_model, old_capacity, alphabet_size);
+    huffman_histogram_grow(&encoder->scratch, encoder->model, old_capacity, alphabet_size);
+    huffman_ans_table_grow(&encoder->scratch, encoder->ans_table, old_capacity, alphabet_size);
+    encoder->alphabet_capacity = alphabet_size;
+    return true;
+}
+
+[[nodiscard]] bool huffman_encoder_set_symbol_size(HuffmanEncoder* encoder, size_t symbol_size) {
+    assert(symbol_size >= 1 && symbol_size <= HUFFMAN_MAX_SYMBOL_SIZE);
+    if (!huffman_encoder_set_default_model(encoder, 0, huffman_alphabet_size(symbol_size))) return false;
+    encoder->symbol_size = symbol_size;
+    return true;
+}
+
+void huffman_encoder_reset(HuffmanEncoder* encoder) {
+    encoder->has_previous = false;
+    encoder->has_carry = false;
+    encoder->frame_started = false;
+    huffman_histogram_copy(encoder->model, encoder->default_model);
+    encoder->bits = (BitWriterMemoryUserdata){0};
+    if (encoder->push) {
+        encoder->push->input_len = 0;
+        encoder->push->output_offset = 0;
+        encoder->push->started = false;
+        encoder->push->finished = false;
+    }
+}
+
+void huffman_encoder_deinit(HuffmanEncoder* encoder) {
+    arena_deinit(&encoder->scratch);
+    *encoder = (HuffmanEncoder){0};
+}
+
+// Codes up to one level block size of symbols, in several blocks at the levels
+// with a boundary search. The trailing byte follows the last symbol if last is set.
+bool huffman_encoder_write_region(HuffmanEncoder* encoder, BitWriter writer, const unsigned char* msg, size_t region_len, bool last, bool trailing_byte) {
+    const HuffmanLevelParams* params = &huffman_level_params[encoder->level];
+    size_t symbol_size = encoder->symbol_size;
+    size_t min_split_size = params->min_split_size / symbol_size;
+    HuffmanTable* huffman_table = encoder->table;
+    HuffmanTable* previous_table = encoder->previous_table;
+    HuffmanHistogram* histogram = encoder->histogram;
+    Arena scratch = encoder->scratch;
+    size_t block_count = 0;
+    size_t* block_sizes = &region_len;
+    if (min_split_size) {
+        block_sizes = arena_new(&scratch, size_t, region_len / min_split_size + 1);
+        huffman_plan_blocks(scratch, msg, region_len, symbol_size, min_split_size, histogram, block_sizes, &block_count);
+    }
+    else {
+        block_count = 1;
+    }
+    size_t offset = 0;
+    for (size_t block = 0; block < block_count; block++) {
+        const unsigned char* block_msg = msg + offset*symbol_size;
+        size_t block_len = block_sizes[block];
+        huffman_histogram(block_msg, block_len, symbol_size, params->sample_step, histogram);
+        size_t sample_step = symbol_size == 1 ? params->sample_step : 1;
+        // Payload and header costs in sampled units
+        uint64_t reuse_cost = encoder->has_previous ? huffman_payload_bits(previous_table, histogram) : UINT64_MAX;
+        bool reuse = false;
+        if (params->reuse_slack && reuse_cost != UINT64_MAX) {
+            // No table codes below the entropy, the fast levels skip building
+            // one when the previous table is already close to it
+            uint64_t bound = huffman_entropy_bits(histogram) + huffman_table_header_bits(previous_table) / sample_step;
+            reuse = reuse_cost*1000 <= bound*(1000 + params->reuse_slack);
+        }
+        uint64_t huffman_cost = reuse_cost;
+        if (!reuse) {
+            uint64_t new_cost = 0;
+            if (min_split_size) {
+                new_cost = huffman_best_table(scratch, histogram, huffman_table);
+            }
+            else {
+                huffman_table_from_histogram(scratch, histogram, HUFFMAN_MAX_CODE_LEN, huffman_table);
+                new_cost = huffman_payload_bits(huffman_table, histogram)
+                    + huffman_table_header_bits(huffman_table) / sample_step;
+            }
+            reuse = reuse_cost != UINT64_MAX
+                && reuse_cost*1000 <= new_cost*(1000 + params->reuse_slack);
+            huffman_cost = reuse ? reuse_cost : new_cost;
+        }
+        // Skewed blocks, where Huffman spends a whole bit on a likely symbol
+        bool ans = huffman_ans_cost(histogram, encoder->ans_table, huffman_cost, sample_step) != UINT64_MAX;
+        offset += block_len;
+        unsigned char flags = 0;
+        if (last && offset == region_len) flags |= HUFFMAN_BLOCK_LAST;
+        if (last && offset == region_len && trailing_byte) flags |= HUFFMAN_BLOCK_TRAILING_BYTE;
+        if (ans) {
+            if (!write_ans_block(scratch, encoder->ans_table, flags, writer, block_msg, block_len, symbol_size)) return false;
+            continue;
+        }
+        if (reuse) flags |= HUFFMAN_BLOCK_REUSE_TABLE;
+        HuffmanTable* table = reuse ? previous_table : huffman_table;
+        if (!write_block(table, flags, writer, block_msg, block_len, symbol_size)) return false;
+        if (!reuse) {
+            huffman_table_copy(previous_table, huffman_table);
+            encoder->has_previous = true;
+        }
+    }
+    return true;
+}
+
+[[nodiscard]] bool huffman_encoder_write(HuffmanEncoder* encoder, BitWriter writer, const char* msg_in, size_t msg_len) {
+    const unsigned char* msg = (const unsigned char*)msg_in;
+    size_t symbol_size = encoder->symbol_size;
+    size_t symbol_count = msg_len / symbol_size;
+    bool trailing_byte = msg_len % symbol_size != 0;
+    size_t block_size = huffman_level_params[encoder->level].block_size / symbol_size;
+    encoder->has_previous = false;
+    if (!write_frame_header(writer)) return false;
+    size_t offset = 0;
+    do {
+        size_t region_len = symbol_count - offset;
+        if (region_len > block_size) region_len = block_size;
+        offset += region_len;
+        if (!huffman_encoder_write_region(encoder, writer, msg + (offset - region_len)*symbol_size, region_len, offset == symbol_count, trailing_byte)) return false;
+    } while (offset < symbol_count);
+    return write_frame_end(writer);
+}
+
+// Both sides fold every block into the model the same way, so they agree on
+// the next adaptive table without transmitting it
+void huffman_model_prepare(HuffmanHistogram* model, HuffmanHistogram* default_model, size_t alphabet_size) {
+    if (model->alphabet_size == alphabet_size) return;
+    if (default_model->alphabet_size == alphabet_size) huffman_histogram_copy(model, default_model);
+    else huffman_histogram_uniform(model, alphabet_size);
+}
+
+// Counts below this lose nothing to the decay, model counts never drop below one
+#define HUFFMAN_MODEL_DECAYING (4)
+
+void huffman_model_update(HuffmanHistogram* model, HuffmanHistogram* block) {
+    assert(model->symbol_count == model->alphabet_size);
+    int64_t* frequencies = model->frequencies;
+    size_t kept = 0;
+    for (size_t i = 0; i < model->decaying_count; i++) {
+        uint16_t symbol = model->decaying[i];
+        frequencies[symbol] -= frequencies[symbol] / 4;
+        if (frequencies[symbol] >= HUFFMAN_MODEL_DECAYING) model->decaying[kept++] = symbol;
+    }
+    model->decaying_count = kept;
+    for (size_t i = 0; i < block->symbol_count; i++) {
+        uint16_t symbol = block->symbols[i];
+        bool listed = frequencies[symbol] >= HUFFMAN_MODEL_DECAYING;
+        frequencies[symbol] += block->frequencies[symbol];
+        if (!listed && frequencies[symbol] >= HUFFMAN_MODEL_DECAYING) model->decaying[model->decaying_count++] = symbol;
+    }
+}
+
+void huffman_model_set(HuffmanHistogram* model, const int64_t* frequencies, size_t alphabet_size) {
+    huffman_histogram_uniform(model, alphabet_size);
+    for (size_t i = 0; frequencies && i < alphabet_size; i++) {
+        if (frequencies[i] > 0) model->frequencies[i] = frequencies[i];
+        if (model->frequencies[i] >= HUFFMAN_MODEL_DECAYING) model->decaying[model->decaying_count++] = i;
+    }
+}
+
+[[nodiscard]] bool huffman_encoder_set_default_model(HuffmanEncoder* encoder, const int64_t* frequencies, size_t alphabet_size) {
+    if (!huffman_encoder_reserve_alphabet(encoder, alphabet_size)) return false;
+    huffman_model_set(encoder->default_model, frequencies, alphabet_size);
+    huffman_histogram_copy(encoder->model, encoder->default_model);
+    return true;
+}
+
+bool huffman_encoder_stream_blocks(HuffmanEncoder* encoder, Arena scratch, BitWriter writer, const unsigned char* msg, size_t symbol_count) {
+    const HuffmanLevelParams* params = &huffman_level_params[encoder->level];
+    size_t symbol_size = encoder->symbol_size;
+    size_t block_size = params->block_size / symbol_size;
+    huffman_model_prepare(encoder->model, encoder->default_model, huffman_alphabet_size(symbol_size));
+    for (size_t offset = 0; offset < symbol_count;) {
+        size_t block_len = symbol_count - offset;
+        if (block_len > block_size) block_len = block_size;
+        const unsigned char* block_msg = msg + offset*symbol_size;
+        huffman_table_from_histogram(scratch, encoder->model, HUFFMAN_MAX_CODE_LEN, encoder->table);
+        if (!write_block(encoder->table, HUFFMAN_BLOCK_ADAPTIVE_TABLE, writer, block_msg, block_len, symbol_size)) return false;
+        huffman_histogram(block_msg, block_len, symbol_size, 1, encoder->histogram);
+        huffman_model_update(encoder->model, encoder->histogram);
+        offset += block_len;
+    }
+    return true;
+}
+
+// Streaming and push coding write the frame header with their first output
+bool huffman_encoder_start_frame(HuffmanEncoder* encoder, BitWriter writer) {
+    if (encoder->frame_started) return true;
+    encoder->frame_started = true;
+    return write_frame_header(writer);
+}
+
+[[nodiscard]] bool huffman_encoder_stream_write(HuffmanEncoder* encoder, BitWriter writer, const char* chunk, size_t len) {
+    if (!huffman_encoder_start_frame(encoder, writer)) return false;
+    Arena scratch = encoder->scratch;
+    const unsigned char* msg = (const unsigned char*)chunk;
+    if (encoder->has_carry && len > 0) {
+        if (!huffman_arena_has_room(&scratch, len + 1, 1)) return false;
+        unsigned char* joined = arena_alloc_ex(&scratch, len + 1, 0, 1, 1);
+        joined[0] = encoder->carry;
+        memcpy(joined + 1, chunk, len);
+        msg = joined;
+        len += 1;
+        encoder->has_carry = false;
+    }
+    size_t symbol_count = len / encoder->symbol_size;
+    if (len % encoder->symbol_size) {
+        encoder->carry = msg[len - 1];
+        encoder->has_carry = true;
+    }
+    return huffman_encoder_stream_blocks(encoder, scratch, writer, msg, symbol_count);
+}
+
+[[nodiscard]] bool huffman_encoder_stream_end(HuffmanEncoder* encoder, BitWriter writer) {
+    unsigned char flags = HUFFMAN_BLOCK_ADAPTIVE_TABLE | HUFFMAN_BLOCK_LAST;
+    if (encoder->has_carry) flags |= HUFFMAN_BLOCK_TRAILING_BYTE;
+    if (!huffman_encoder_start_frame(encoder, writer)) return false;
+    huffman_model_prepare(encoder->model, encoder->default_model, huffman_alphabet_size(encoder->symbol_size));
+    huffman_table_from_histogram(encoder->scratch, encoder->model, HUFFMAN_MAX_CODE_LEN, encoder->table);
+    if (!write_block(encoder->table, flags, writer, &encoder->carry, 0, encoder->symbol_size)) return false;
+    encoder->has_carry = false;
+    encoder->frame_started = false;
+    return write_frame_end(writer);
+}
+
+size_t huffman_compress_bound(size_t len) {
+    // The longest code for every symbol, a block header per 2KiB, a table
+    // entry for every symbol (gap and length, at most 5 bytes), a full byte
+    // table for every sampled block, which codes unseen bytes too, and the
+    // frame header and end
+    size_t blocks = len / (1<<11) + 1;
+    size_t sampled_blocks = len / huffman_level_params[HUFFMAN_LEVEL_FASTEST].block_size + 1;
+    return blocks * (1 + 4 + 4) + sampled_blocks*256*5 + len*(HUFFMAN_MAX_CODE_LEN/8) + len*5 + HUFFMAN_FRAME_HEADER_SIZE + 2;
+}
+
+[[nodiscard]] bool huffman_encoder_compress(HuffmanEncoder* encoder, const char* msg, size_t msg_len, unsigned char* out, size_t out_capacity, size_t* out_len) {
+    encoder->bits = (BitWriterMemoryUserdata){
+        .data = out,
+        .capacity = out_capacity,
+    };
+    BitWriter writer = {
+        .write_bit = memory_write_bit,
+        .flush = memory_flush,
+        .userdata = &encoder->bits,
+    };
+    bool ok = huffman_encoder_write(encoder, writer, msg, msg_len);
+    *out_len = encoder->bits.len;
+    return ok;
+}
+
+HuffmanPushStatus huffman_encoder_push(HuffmanEncoder* encoder, const char* in, size_t in_len, bool finish, size_t* in_consumed, unsigned char* out, size_t out_capacity, size_t* out_len) {
+    *in_consumed = 0;
+    *out_len = 0;
+    if (!encoder->push) {
+        size_t block_size = huffman_level_params[encoder->level].block_size;
+        if (block_size > HUFFMAN_PUSH_BLOCK_SIZE) block_size = HUFFMAN_PUSH_BLOCK_SIZE;
+        size_t output_capacity = huffman_compress_bound(block_size);
+        if (!huffman_arena_has_room(&encoder->scratch, sizeof(HuffmanPushEncoder) + block_size + output_capacity, 3)) return HUFFMAN_PUSH_ERROR;
+        HuffmanPushEncoder* push = arena_new(&encoder->scratch, HuffmanPushEncoder, 1);
+        push->block_size = block_size;
+        push->input = arena_alloc_ex(&encoder->scratch, block_size, 0, 1, 1);
+        push->output_capacity = output_capacity;
+        push->output = arena_alloc_ex(&encoder->scratch, push->output_capacity, 0, 1, 1);
+        encoder->push = push;
+    }
+    HuffmanPushEncoder* push = encoder->push;
+    if (!push->started) {
+        // Nothing left over from whole-message or streaming coding may leak
+        // into the first block, the decoder starts from a clean context
+        huffman_encoder_reset(encoder);
+        push->started = true;
+    }
+    size_t symbol_size = encoder->symbol_size;
+    BitWriter writer = {
+        .write_bit = memory_write_bit,
+        .flush = memory_flush,
+        .userdata = &encoder->bits,
+    };
+    while (true) {
+        // Hand out what is coded before coding more
+        size_t pending = encoder->bits.len - push->output_offset;
+        size_t n = pending < out_capacity - *out_len ? pending : out_capacity - *out_len;
+        memcpy(out + *out_len, push->output + push->output_offset, n);
+        push->output_offset += n;
+        *out_len += n;
+        if (push->output_offset < encoder->bits.len) return HUFFMAN_PUSH_NEED_OUTPUT;
+        // Bits of an unfinished byte stay in the writer
+        encoder->bits.data = push->output;
+        encoder->bits.capacity = push->output_capacity;
+        encoder->bits.len = 0;
+        push->output_offset = 0;
+        if (push->finished) return HUFFMAN_PUSH_DONE;
+
+        size_t take = in_len - *in_consumed;
+        if (take > push->block_size - push->input_len) take = push->block_size - push->input_len;
+        memcpy(push->input + push->input_len, in + *in_consumed, take);
+        push->input_len += take;
+        *in_consumed += take;
+        bool more = *in_consumed < in_len;
+        if (push->input_len == push->block_size && more) {
+            // Only a block followed by more input is known not to be the last
+            if (!huffman_encoder_start_frame(encoder, writer)) return HUFFMAN_PUSH_ERROR;
+            if (!huffman_encoder_write_region(encoder, writer, push->input, push->block_size / symbol_size, false, false)) return HUFFMAN_PUSH_ERROR;
+            push->input_len = 0;
+        }
+        else if (finish && !more) {
+            size_t symbol_count = push->input_len / symbol_size;
+            bool trailing_byte = push->input_len % symbol_size != 0;
+            if (!huffman_encoder_start_frame(encoder, writer)) return HUFFMAN_PUSH_ERROR;
+            if (!huffman_encoder_write_region(encoder, writer, push->input, symbol_count, true, trailing_byte)) return HUFFMAN_PUSH_ERROR;
+            encoder->frame_started = false;
+            if (!write_frame_end(writer)) return HUFFMAN_PUSH_ERROR;
+            push->input_len = 0;
+            push->finished = true;
+        }
+        else {
+            return HUFFMAN_PUSH_NEED_INPUT;
+        }
+    }
+}
+
+[[nodiscard]] bool huffman_write_level(Arena arena, BitWriter writer, char* msg, size_t msg_len, int level) {
+    // Borrow the caller's arena as scratch, nothing outlives this call
+    HuffmanEncoder encoder = {
+        .scratch = arena,
+        .level = level < HUFFMAN_LEVEL_FASTEST ? HUFFMAN_LEVEL_FASTEST : level > HUFFMAN_LEVEL_MAX ? HUFFMAN_LEVEL_MAX : level,
+        .symbol_size = 1,
+    };
+    encoder.table = arena_new(&encoder.scratch, HuffmanTable, 1);
+    encoder.previous_table = arena_new(&encoder.scratch, HuffmanTable, 1);
+    encoder.histogram = arena_new(&encoder.scratch, HuffmanHistogram, 1);
+    encoder.ans_table = arena_new(&encoder.scratch, HuffmanAnsTable, 1);
+    huffman_table_init(&encoder.scratch, encoder.table, 256);
+    huffman_table_init(&encoder.scratch, encoder.previous_table, 256);
+    huffman_histogram_init(&encoder.scratch, encoder.histogram, 256);
+    huffman_ans_table_init(&encoder.scratch, encoder.ans_table, 256);
+    return huffman_encoder_write(&encoder, writer, msg, msg_len);
+}
+
+[[nodiscard]] bool huffman_write(Arena arena, BitWriter writer, char* msg, size_t msg_len) {
+    return huffman_write_level(arena, writer, msg, msg_len, HUFFMAN_LEVEL_DEFAULT);
+}
+
+// Sets the decoder up in scratch it does not own, false if that is too small
+bool huffman_decoder_setup(HuffmanDecoder* decoder, Arena scratch) {
+    *decoder = (HuffmanDecoder){
+        .scratch = scratch,
+        .thread_count = 1,
+    };
+    size_t struct_bytes = sizeof(HuffmanTable) + sizeof(HuffmanDecodeTable) + 3*sizeof(HuffmanHistogram)
+        + sizeof(HuffmanAnsTable) + sizeof(HuffmanAnsDecodeTable);
+    if (!huffman_arena_has_room(&decoder->scratch, struct_bytes, 7)) return false;
+    decoder->table = arena_new(&decoder->scratch, HuffmanTable, 1);
+    decoder->built_table = arena_new(&decoder->scratch, HuffmanDecodeTable, 1);
+    decoder->decode_table = decoder->built_table;
+    decoder->histogram = arena_new(&decoder->scratch, HuffmanHistogram, 1);
+    decoder->default_model = arena_new(&decoder->scratch, HuffmanHistogram, 1);
+    decoder->model = arena_new(&decoder->scratch, HuffmanHistogram, 1);
+    decoder->ans_table = arena_new(&decoder->scratch, HuffmanAnsTable, 1);
+    decoder->ans_decode_table = arena_new(&decoder->scratch, HuffmanAnsDecodeTable, 1);
+    return huffman_decoder_set_default_model(decoder, 0, 256);
+}
+
+[[nodiscard]] bool huffman_decoder_init(HuffmanDecoder* decoder, ptrdiff_t scratch_size) {
+    Arena scratch = arena_init(scratch_size);
+    if (!scratch.memory) {
+        *decoder = (HuffmanDecoder){0};
+        return false;
+    }
+    if (!huffman_decoder_setup(decoder, scratch)) {
+        huffman_decoder_deinit(decoder);
+        return false;
+    }
+    return true;
+}
+
+void huffman_decode_table_grow(Arena* arena, HuffmanDecodeTable* table, size_t old_capacity, size_t capacity) {
+    uint16_t* symbols = arena_new(arena, uint16_t, capacity);
+    if (old_capacity) memcpy(symbols, table->symbols, old_capacity*sizeof(uint16_t));
+    table->symbols = symbols;
+}
+
+// Grows the tables, histograms, models and cached decode tables to
+// alphabet_size symbols, on the first 16-bit block or model
+bool huffman_decoder_reserve_alphabet(HuffmanDecoder* decoder, size_t alphabet_size) {
+    size_t old_capacity = decoder->alphabet_capacity;
+    if (alphabet_size <= old_capacity) return true;
+    HuffmanTableCache* cache = decoder->table_cache;
+    size_t decode_tables = 1 + (cache ? cache->capacity : 0);
+    size_t bytes = huffman_table_bytes(alphabet_size)
+        + 3*huffman_histogram_bytes(alphabet_size)
+        + huffman_ans_table_bytes(alphabet_size)
+        + decode_tables*alphabet_size*sizeof(uint16_t);
+    if (!huffman_arena_has_room(&decoder->scratch, bytes, 13 + decode_tables)) return false;
+    huffman_table_grow(&decoder->scratch, decoder->table, old_capacity, alphabet_size);
+    huffman_histogram_grow(&decoder->scratch, decoder->histogram, old_capacity, alphabet_size);
+    huffman_histogram_grow(&decoder->scratch, decoder->default_model, old_capacity, alphabet_size);
+    huffman_histogram_grow(&decoder->scratch, decoder->model, old_capacity, alphabet_size);
+    huffman_ans_table_grow(&decoder->scratch, decoder->ans_table, old_capacity, alphabet_size);
+    huffman_decode_table_grow(&decoder->scratch, decoder->built_table, old_capacity, alphabet_size);
+    for (size_t i = 0; cache && i < cache->capacity; i++) {
+        huffman_decode_table_grow(&decoder->scratch, cache->slots[i].decode_table, old_capacity, alphabet_size);
+    }
+    decoder->alphabet_capacity = alphabet_size;
+    return true;
+}
+
+[[nodiscard]] bool huffman_decoder_set_default_model(HuffmanDecoder* decoder, const int64_t* frequencies, size_t alphabet_size) {
+    if (!huffman_decoder_reserve_alphabet(decoder, alphabet_size)) return false;
+    huffman_model_set(decoder->default_model, frequencies, alphabet_size);
+    huffman_histogram_copy(decoder->model, decoder->default_model);
+    return true;
+}
+
+typedef enum {
+    HUFFMAN_PUSH_STEP_FRAME_HEADER,
+    HUFFMAN_PUSH_STEP_BLOCK_FLAGS,
+    HUFFMAN_PUSH_STEP_TABLE_HEADER,
+    HUFFMAN_PUSH_STEP_TABLE_ENTRY,
+    HUFFMAN_PUSH_STEP_BLOCK_LENGTH,
+    HUFFMAN_PUSH_STEP_ANS_STATE,
+    HUFFMAN_PUSH_STEP_SYMBOLS,
+    HUFFMAN_PUSH_STEP_TRAILING_BYTE,
+    HUFFMAN_PUSH_STEP_END_MARKER,
+    HUFFMAN_PUSH_STEP_FINISHED,
+    HUFFMAN_PUSH_STEP_FAILED,
+} HuffmanPushStep;
+
+// Input waiting to be decoded, at most one unit (a header field, table entry
+// or code) is ever left incomplete so this only has to hold a fragment
+#define HUFFMAN_PUSH_BUFFER_SIZE (1<<16)
+
+typedef struct HuffmanPushDecoder {
+    HuffmanPushStep step;
+    unsigned char* buffer; // Read through decoder->bits
+    size_t nobfel;
+    size_t entries_left;
+    uint32_t previous_symbol;
+    size_t symbols_left;
+    uint32_t ans_states[2]; // The first decodes the next symbol
+    unsigned char pending[HUFFMAN_MAX_SYMBOL_SIZE]; // Bytes of a symbol that did not fit the output
+    size_t pending_len;
+    size_t pending_offset;
+    bool started; // A message is being pushed, cleared by huffman_decoder_reset
+} HuffmanPushDecoder;
+
+void huffman_decoder_set_threads(HuffmanDecoder* decoder, size_t thread_count) {
+    decoder->thread_count = thread_count ? thread_count : 1;
+}
+
+// Frames are decoded independently, nothing carries over from the previous one
+void huffman_decoder_start_frame(HuffmanDecoder* decoder) {
+    decoder->in_frame = false;
+    decoder->legacy = false;
+    decoder->has_table = false;
+    decoder->flags = 0;
+    huffman_histogram_copy(decoder->model, decoder->default_model);
+}
+
+void huffman_decoder_reset(HuffmanDecoder* decoder) {
+    huffman_decoder_start_frame(decoder);
+    decoder->bits = (BitReaderMemoryUserdata){0};
+    if (decoder->push) {
+        *decoder->push = (HuffmanPushDecoder){.buffer = decoder->push->buffer};
+    }
+}
+
+void huffman_decoder_deinit(HuffmanDecoder* decoder) {
+    arena_deinit(&decoder->scratch);
+    *decoder = (HuffmanDecoder){0};
+}
+
+size_t huffman_decoder_symbol_size(HuffmanDecoder* decoder) {
+    return (decoder->flags & HUFFMAN_BLOCK_WIDE_SYMBOLS) ? 2 : 1;
+}
+
+void huffman_decoder_use_table(HuffmanDecoder* decoder) {
+    //print_huffman_table(decoder->table);
+    decoder->decode_table = decoder->built_table;
+    huffman_decode_table_build(decoder->decode_table, decoder->table);
+    decoder->has_table = true;
+}
+
+// Looks a transmitted table up in the table cache, and builds it into the
+// least recently used slot if it is not there
+void huffman_decoder_use_transmitted_table(HuffmanDecoder* decoder) {
+    HuffmanTableCache* cache = decoder->table_cache;
+    if (!cache || !cache->slot_count) {
+        huffman_decoder_use_table(decoder);
+        return;
+    }
+    uint64_t fingerprint = huffman_table_fingerprint(decoder->table);
+    cache->clock += 1;
+    HuffmanTableCacheSlot* victim = &cache->slots[0];
+    for (size_t i = 0; i < cache->slot_count; i++) {
+        HuffmanTableCacheSlot* slot = &cache->slots[i];
+        if (slot->last_use && slot->fingerprint == fingerprint && huffman_decode_table_matches(slot->decode_table, decoder->table)) {
+            slot->last_use = cache->clock;
+            cache->stats.hits += 1;
+            decoder->decode_table = slot->decode_table;
+            decoder->has_table = true;
+            return;
+        }
+        if (slot->last_use < victim->last_use) victim = slot;
+    }
+    cache->stats.misses += 1;
+    if (victim->last_use) cache->stats.evictions += 1;
+    victim->fingerprint = fingerprint;
+    victim->last_use = cache->clock;
+    huffman_decode_table_build(victim->decode_table, decoder->table);
+    decoder->decode_table = victim->decode_table;
+    decoder->has_table = true;
+}
+
+[[nodiscard]] bool huffman_decoder_set_table_cache(HuffmanDecoder* decoder, size_t slot_count) {
+    size_t old_capacity = decoder->table_cache ? decoder->table_cache->capacity : 0;
+    if (slot_count > old_capacity) {
+        size_t new_slots = slot_count - old_capacity;
+        size_t bytes = sizeof(HuffmanTableCache) + slot_count*sizeof(HuffmanTableCacheSlot)
+            + new_slots*(sizeof(HuffmanDecodeTable) + decoder->alphabet_capacity*sizeof(uint16_t));
+        if (!huffman_arena_has_room(&decoder->scratch, bytes, 2 + 2*new_slots)) return false;
+    }
+    if (!decoder->table_cache) decoder->table_cache = arena_new(&decoder->scratch, HuffmanTableCache, 1);
+    HuffmanTableCache* cache = decoder->table_cache;
+    if (slot_count > cache->capacity) {
+        // Slots keep their decode tables, only the new ones get theirs. The
+        // decode tables follow the slot array, so the array itself is copied,
+        // a few dozen bytes per slot left behind in the scratch.
+        HuffmanTableCacheSlot* slots = arena_new(&decoder->scratch, HuffmanTableCacheSlot, slot_count);
+        if (cache->capacity) memcpy(slots, cache->slots, cache->capacity*sizeof(HuffmanTableCacheSlot));
+        cache->slots = slots;
+        for (size_t i = cache->capacity; i < slot_count; i++) {
+            cache->slots[i].decode_table = arena_new(&decoder->scratch, HuffmanDecodeTable, 1);
+            cache->slots[i].decode_table->symbols = arena_new(&decoder->scratch, uint16_t, decoder->alphabet_capacity);
+        }
+        cache->capacity = slot_count;
+    }
+    for (size_t i = 0; i < cache->capacity; i++) cache->slots[i].last_use = 0;
+    cache->slot_count = slot_count;
+    cache->clock = 0;
+    cache->stats = (HuffmanTableCacheStats){0};
+    decoder->decode_table = decoder->built_table;
+    decoder->has_table = false;
+    return true;
+}
+
+HuffmanTableCacheStats huffman_decoder_table_cache_stats(HuffmanDecoder* decoder) {
+    return decoder->table_cache ? decoder->table_cache->stats : (HuffmanTableCacheStats){0};
+}
+
+// Sets up the table of a block once its flags are known, false if the table
+// is transmitted and still has to be read
+bool huffman_decoder_prepare_table(HuffmanDecoder* decoder) {
+    if (decoder->flags & HUFFMAN_BLOCK_ANS) return false;
+    size_t alphabet_size = huffman_alphabet_size(huffman_decoder_symbol_size(decoder));
+    if (decoder->flags & HUFFMAN_BLOCK_ADAPTIVE_TABLE) {
+        huffman_model_prepare(decoder->model, decoder->default_model, alphabet_size);
+    }
+    if (decoder->flags & HUFFMAN_BLOCK_REUSE_TABLE) return true;
+    if (decoder->flags & HUFFMAN_BLOCK_ADAPTIVE_TABLE) {
+        huffman_table_from_histogram(decoder->scratch, decoder->model, HUFFMAN_MAX_CODE_LEN, decoder->table);
+        huffman_decoder_use_table(decoder);
+        return true;
+    }
+    return false;
+}
+
+bool huffman_decoder_check_block(HuffmanDecoder* decoder, size_t block_len) {
+    size_t alphabet_size = huffman_alphabet_size(huffman_decoder_symbol_size(decoder));
+    if (decoder->flags & HUFFMAN_BLOCK_ANS) {
+        // tANS tables are never reused or adaptive, and never empty
+        if (decoder->flags & (HUFFMAN_BLOCK_REUSE_TABLE | HUFFMAN_BLOCK_ADAPTIVE_TABLE)) return false;
+        return decoder->ans_table->alphabet_size == alphabet_size;
+    }
+    if (!decoder->has_table || decoder->table->alphabet_size != alphabet_size) return false;
+    if (block_len && !decoder->table->symbol_count) return false;
+    return true;
+}
+
+// Checks the magic and version after their first byte
+bool huffman_decoder_check_frame_header(BitReader reader, unsigned char first) {
+    if (first != huffman_frame_magic[0]) return false;
+    for (size_t i = 1; i < sizeof(huffman_frame_magic); i++) {
+        unsigned char byte = 0;
+        if (!read_byte(reader, &byte) || byte != huffman_frame_magic[i]) return false;
+    }
+    unsigned char version = 0;
+    return read_byte(reader, &version) && version == HUFFMAN_FORMAT_VERSION;
+}
+
+// A legacy frame is read as a single last block with its own kind of table.
+// Memory input decodes it with the kernels, on several threads if set.
+bool huffman_decoder_read_legacy_header(HuffmanDecoder* decoder, BitReader reader, unsigned char nobfel, size_t* block_len) {
+    if (!decoder->legacy_tree) decoder->legacy_tree = arena_new(&decoder->scratch, HuffmanLegacyTree, 1);
+    if (!read_legacy_table(decoder->legacy_tree, reader, nobfel)) return false;
+    decoder->decode_table = decoder->built_table;
+    huffman_legacy_decode_table_build(decoder->decode_table, decoder->legacy_tree);
+    decoder->flags = HUFFMAN_BLOCK_LAST;
+    *block_len = read_encoded_message_length(reader);
+    return true;
+}
+
+// Every code takes at least a bit, a block claiming more symbols than there are
+// bits left is damaged or not ours. tANS symbols can take less than a bit.
+bool huffman_decoder_check_block_len(HuffmanDecoder* decoder, BitReader reader, size_t block_len) {
+    if ((decoder->flags & HUFFMAN_BLOCK_ANS) || reader.read_bit != memory_read_bit) return true;
+    BitReaderMemoryUserdata* bits = (BitReaderMemoryUserdata*)reader.userdata;
+    return block_len <= bits->len*8 - bits->bit_offset;
+}
+
+// Reads a block header and its table, returns the number of symbols in the block.
+// The first block of a frame also reads the frame header.
+bool huffman_decoder_read_block_header(HuffmanDecoder* decoder, BitReader reader, size_t* block_len) {
+    if (!decoder->in_frame) {
+        unsigned char first = 0;
+        if (!read_byte(reader, &first)) return false;
+        decoder->in_frame = true;
+        decoder->legacy = first != huffman_frame_magic[0];
+        if (decoder->legacy) {
+            return huffman_decoder_read_legacy_header(decoder, reader, first, block_len)
+                && huffman_decoder_check_block_len(decoder, reader, *block_len);
+        }
+        if (!huffman_decoder_check_frame_header(reader, first)) return false;
+    }
+    if (!read_byte(reader, &decoder->flags)) return false;
+    if (!huffman_decoder_reserve_alphabet(decoder, huffman_alphabet_size(huffman_decoder_symbol_size(decoder)))) return false;
+    if (!huffman_decoder_prepare_table(decoder)) {
+        size_t alphabet_size = huffman_alphabet_size(huffman_decoder_symbol_size(decoder));
+        if (decoder->flags & HUFFMAN_BLOCK_ANS) {
+            if (!read_ans_table(decoder->ans_table, reader, alphabet_size)) return false;
+            huffman_ans_decode_table_build(decoder->scratch, decoder->ans_decode_table, decoder->ans_table);
+        }
+        else {
+            if (!read_huffman_table(decoder->table, reader, alphabet_size)) return false;
+            huffman_decoder_use_transmitted_table(decoder);
+        }
+    }
+    *block_len = read_encoded_message_length(reader);
+    return huffman_decoder_check_block(decoder, *block_len)
+        && huffman_decoder_check_block_len(decoder, reader, *block_len);
+}
+
+// Speculative chunks remember where their first codes start, a chunk whose
+// true start is found among them needs no rescan
+#define HUFFMAN_SYNC_WINDOW (64)
+// Chunks below this many bits cost more in thread startup than they save
+#define HUFFMAN_MIN_CHUNK_BITS (1<<18)
+
+typedef struct {
+    const HuffmanKernels* kernels;
+    const HuffmanDecodeTable* table;
+    const unsigned char* data;
+    size_t len;
+    size_t start; // Bit where decoding starts, speculative until fixed up
+    size_t end; // Nominal end, the chunk owns the code that crosses it
+    size_t exit; // Bit after the chunk's last code
+    size_t count;
+    bool valid;
+    size_t boundaries[HUFFMAN_SYNC_WINDOW];
+    size_t boundary_count;
+    unsigned char* symbols; // Decoded from start, in scratch
+    size_t symbol_size;
+} HuffmanDecodeChunk;
+
+int huffman_decode_chunk_scan(void* userdata) {
+    HuffmanDecodeChunk* chunk = (HuffmanDecodeChunk*)userdata;
+    chunk->valid = chunk->kernels->scan(
+        chunk->table, chunk->data, chunk->len, chunk->start, chunk->end,
+        chunk->boundaries, HUFFMAN_SYNC_WINDOW, chunk->symbols, chunk->symbol_size, &chunk->exit, &chunk->count
+    );
+    chunk->boundary_count = chunk->count < HUFFMAN_SYNC_WINDOW ? chunk->count : HUFFMAN_SYNC_WINDOW;
+    return 0;
+}
+
+// Runs one chunk on the calling thread and the others on their own threads
+void huffman_decode_chunks(Arena scratch, int (*run)(void*), HuffmanDecodeChunk* chunks, size_t chunk_count) {
+#ifndef __STDC_NO_THREADS__
+    thrd_t* threads = arena_new(&scratch, thrd_t, chunk_count);
+    bool* started = arena_new(&scratch, bool, chunk_count);
+    for (size_t i = 1; i < chunk_count; i++) {
+        started[i] = thrd_create(&threads[i], run, &chunks[i]) == thrd_success;
+        if (!started[i]) run(&chunks[i]);
+    }
+    run(&chunks[0]);
+    for (size_t i = 1; i < chunk_count; i++) {
+        if (started[i]) thrd_join(threads[i], 0);
+    }
+#else
+    (void)scratch;
+    for (size_t i = 0; i < chunk_count; i++) {
+        run(&chunks[i]);
+    }
+#endif
+}
+
+// Bits the codes of symbols take
+size_t huffman_decode_table_bits(Arena scratch, const HuffmanDecodeTable* table, const unsigned char* symbols, size_t symbol_count, size_t symbol_size) {
+    uint8_t* lens = arena_new(&scratch, uint8_t, huffman_alphabet_size(symbol_size));
+    for (size_t len = 1; len <= table->max_len; len++) {
+        for (size_t i = 0; i < table->count[len]; i++) {
+            lens[table->symbols[table->offset[len] + i]] = (uint8_t)len;
+        }
+    }
+    size_t bits = 0;
+    for (size_t i = 0; i < symbol_count; i++) {
+        uint32_t symbol = symbol_size == 2 ? (symbols[2*i] | ((uint32_t)symbols[2*i+1] << 8)) : symbols[i];
+        bits += lens[symbol];
+    }
+    return bits;
+}
+
+// Once a decode started at a wrong bit lands on the same code boundary as the
+// true decode, both agree from there on, and Huffman codes resynchronize this
+// way within a few codes. The payload is split into chunks that are decoded
+// in parallel from their nominal starts into scratch. Then, in order, each
+// chunk's first codes are redone from where its predecessor really ends, only
+// until they meet a boundary the speculative decode saw, and the rest of its
+// symbols are copied into place. The last chunk runs a little past the
+// estimated end, what the estimate misses decodes on the calling thread.
+bool huffman_decoder_read_block_parallel(HuffmanDecoder* decoder, BitReaderMemoryUserdata* in, unsigned char* out, size_t block_len, size_t symbol_size) {
+    const HuffmanKernels* kernels = huffman_kernels();
+    HuffmanDecodeTable* table = decoder->decode_table;
+    // The code's lengths imply the symbol distribution it was built for,
+    // which estimates the payload size before it is decoded
+    double expected_len = 0;
+    size_t min_len = 0;
+    for (size_t len = 1; len <= table->max_len; len++) {
+        expected_len += (double)table->count[len] * len / (double)((uint64_t)1 << len);
+        if (!min_len && table->count[len]) min_len = len;
+    }
+    size_t payload_bits = (size_t)(expected_len * block_len);
+    // Tables sampled from part of the block can overestimate it several times,
+    // but the payload never runs past the input
+    size_t input_bits = in->len*8 > in->bit_offset ? in->len*8 - in->bit_offset : 0;
+    if (payload_bits > input_bits) payload_bits = input_bits;
+    size_t chunk_count = payload_bits / HUFFMAN_MIN_CHUNK_BITS;
+    if (chunk_count > decoder->thread_count) chunk_count = decoder->thread_count;
+    if (chunk_count < 2) return kernels->decode(table, in, out, block_len, symbol_size);
+    size_t chunk_bits = payload_bits / chunk_count;
+    size_t last_end = in->bit_offset + payload_bits + chunk_bits/4;
+    if (last_end > in->len*8) last_end = in->len*8;
+
+    // Every chunk needs room for as many symbols as its bits can hold
+    Arena scratch = decoder->scratch;
+    // and the threads theirs, otherwise the block decodes on one thread
+    size_t symbol_bytes = ((last_end - in->bit_offset)/min_len + chunk_count)*symbol_size;
+    size_t bytes = chunk_count*(sizeof(HuffmanDecodeChunk) + 16) + symbol_bytes + huffman_alphabet_size(symbol_size);
+    if (!huffman_arena_has_room(&scratch, bytes, 2*chunk_count + 3)) return kernels->decode(table, in, out, block_len, symbol_size);
+    HuffmanDecodeChunk* chunks = arena_new(&scratch, HuffmanDecodeChunk, chunk_count);
+    for (size_t i = 0; i < chunk_count; i++) {
+        size_t start = in->bit_offset + i*chunk_bits;
+        if (start >= last_end) {
+            chunk_count = i;
+            break;
+        }
+        size_t end = i + 1 < chunk_count && start + chunk_bits < last_end ? start + chunk_bits : last_end;
+        chunks[i] = (HuffmanDecodeChunk){
+            .kernels = kernels,
+            .table = table,
+            .data = in->data,
+            .len = in->len,
+            .start = start,
+            .end = end,
+            .symbols = arena_new(&scratch, unsigned char, ((end - start)/min_len + 1)*symbol_size),
+            .symbol_size = symbol_size,
+        };
+    }
+    huffman_decode_chunks(scratch, huffman_decode_chunk_scan, chunks, chunk_count);
+
+    size_t decoded = 0;
+    size_t bit = in->bit_offset;
+    for (size_t i = 0; i < chunk_count && decoded < block_len; i++) {
+        HuffmanDecodeChunk* chunk = &chunks[i];
+        // Codes of the true stream until one starts where the speculative decode had one
+        size_t k = 0;
+        bool synced = false;
+        while (bit < chunk->end && decoded < block_len) {
+            while (k < chunk->boundary_count && chunk->boundaries[k] < bit) k++;
+            if (k == chunk->boundary_count) break;
+            if (chunk->boundaries[k] == bit) {
+                synced = true;
+                break;
+            }
+            size_t one = 0;
+            if (!kernels->scan(table, in->data, in->len, bit, bit + 1, 0, 0, out + decoded*symbol_size, symbol_size, &bit, &one) || !one) return false;
+            decoded += 1;
+        }
+        if (decoded == block_len) break;
+        if (!synced) {
+            // Not synchronized within the window, decode the rest of the chunk
+            // here. It starts past the chunk's nominal start, so its symbols fit.
+            chunk->valid = kernels->scan(table, in->data, in->len, bit, chunk->end, 0, 0, chunk->symbols, symbol_size, &chunk->exit, &chunk->count);
+            k = 0;
+        }
+        size_t available = chunk->count - k;
+        size_t taken = available < block_len - decoded ? available : block_len - decoded;
+        memcpy(out + decoded*symbol_size, chunk->symbols + k*symbol_size, taken*symbol_size);
+        decoded += taken;
+        bit = chunk->exit;
+        if (taken < available) {
+            // The payload ended inside this chunk, before the codes it decoded past the end
+            unsigned char* rest = chunk->symbols + (k + taken)*symbol_size;
+            bit -= huffman_decode_table_bits(scratch, table, rest, available - taken, symbol_size);
+        }
+        else if (!chunk->valid && decoded < block_len) {
+            return false;
+        }
+    }
+    in->bit_offset = bit;
+    if (decoded < block_len) {
+        return kernels->decode(table, in, out + decoded*symbol_size, block_len - decoded, symbol_size);
+    }
+    return bit <= in->len*8;
+}
+
+// Decodes symbols of the current block from memory, a tANS block carries its two states along
+bool huffman_decoder_decode_symbols(HuffmanDecoder* decoder, BitReaderMemoryUserdata* in, unsigned char* out, size_t symbol_count, uint32_t* ans_states) {
+    size_t symbol_size = huffman_decoder_symbol_size(decoder);
+    if (decoder->flags & HUFFMAN_BLOCK_ANS) {
+        return huffman_kernels()->ans_decode(decoder->ans_decode_table->entries, in, out, symbol_count, symbol_size, ans_states);
+    }
+    return huffman_kernels()->decode(decoder->decode_table, in, out, symbol_count, symbol_size);
+}
+
+// Most bits one symbol of the current block takes
+size_t huffman_decoder_max_symbol_bits(HuffmanDecoder* decoder) {
+    if (decoder->flags & HUFFMAN_BLOCK_ANS) return HUFFMAN_ANS_TABLE_LOG;
+    return decoder->decode_table->max_len;
+}
+
+bool huffman_decoder_read_ans_states(BitReader reader, uint32_t* states) {
+    for (size_t i = 0; i < 2; i++) {
+        uint64_t state = 0;
+        if (!read_bits(reader, HUFFMAN_ANS_TABLE_LOG, &state)) return false;
+        states[i] = (uint32_t)state;
+    }
+    return true;
+}
+
+// The encoder starts both states from the first state and the decoder ends
+// there, any other final state means the bits were damaged
+bool huffman_decoder_read_ans_symbols(HuffmanDecoder* decoder, BitReader reader, unsigned char* out, size_t block_len) {
+    size_t symbol_size = huffman_decoder_symbol_size(decoder);
+    uint32_t states[2] = {0};
+    if (!huffman_decoder_read_ans_states(reader, states)) return false;
+    if (reader.read_bit == memory_read_bit) {
+        if (!huffman_decoder_decode_symbols(decoder, reader.userdata, out, block_len, states)) return false;
+        return states[0] == 0 && states[1] == 0;
+    }
+    for (size_t i = 0; i < block_len; i++) {
+        HuffmanAnsDecodeEntry entry = decoder->ans_decode_table->entries[states[i & 1]];
+        uint64_t low_bits = 0;
+        if (!read_bits(reader, entry.bit_count, &low_bits)) return false;
+        write_symbol(out, i, symbol_size, entry.symbol);
+        states[i & 1] = entry.base + (uint32_t)low_bits;
+    }
+    return states[0] == 0 && states[1] == 0;
+}
+
+// Decodes the symbols of a block and its trailing byte into out, which has
+// room for block_len symbols plus one byte
+bool huffman_decoder_read_block(HuffmanDecoder* decoder, BitReader reader, unsigned char* out, size_t block_len, size_t* out_len) {
+    size_t symbol_size = huffman_decoder_symbol_size(decoder);
+    if (decoder->legacy && (reader.read_bit != memory_read_bit || !decoder->decode_table->legacy_tree)) {
+        for (size_t i = 0; i < block_len; i++) {
+            if (!read_legacy_symbol(decoder->legacy_tree, reader, &out[i])) return false;
+        }
+    }
+    else if (decoder->flags & HUFFMAN_BLOCK_ANS) {
+        if (!huffman_decoder_read_ans_symbols(decoder, reader, out, block_len)) return false;
+    }
+    else if (reader.read_bit == memory_read_bit && decoder->thread_count > 1) {
+        if (!huffman_decoder_read_block_parallel(decoder, reader.userdata, out, block_len, symbol_size)) return false;
+    }
+    else if (reader.read_bit == memory_read_bit) {
+        if (!huffman_kernels()->decode(decoder->decode_table, reader.userdata, out, block_len, symbol_size)) return false;
+    }
+    else {
+        for (size_t i = 0; i < block_len; i++) {
+            uint16_t symbol = 0;
+            if (!read_encoded_message_symbol(decoder->decode_table, reader, &symbol)) return false;
+            write_symbol(out, i, symbol_size, symbol);
+        }
+    }
+    if (decoder->flags & HUFFMAN_BLOCK_ADAPTIVE_TABLE) {
+        huffman_histogram(out, block_len, symbol_size, 1, decoder->histogram);
+        huffman_model_update(decoder->model, decoder->histogram);
+    }
+    *out_len = block_len*symbol_size;
+    if (decoder->flags & HUFFMAN_BLOCK_TRAILING_BYTE) {
+        if (!read_byte(reader, &out[*out_len])) return false;
+        *out_len += 1;
+    }
+    return true;
+}
+
+// Wraps readers other than memory ones, which cannot tell their position or
+// whether input is left, to find where the next frame starts
+typedef struct {
+    BitReader inner;
+    uint64_t bit_offset;
+    bool has_peeked;
+    bool peeked;
+} HuffmanFrameReader;
+
+bool huffman_frame_read_bit(void* userdata, bool* bit) {
+    HuffmanFrameReader* frame = (HuffmanFrameReader*)userdata;
+    if (frame->has_peeked) {
+        frame->has_peeked = false;
+        *bit = frame->peeked;
+    }
+    else if (!frame->inner.read_bit(frame->inner.userdata, bit)) {
+        return false;
+    }
+    frame->bit_offset += 1;
+    return true;
+}
+
+// Reads the end marker after the last block of a frame and the padding up to
+// the next byte. Compressed messages concatenated byte-wise therefore decode as
+// one, more is set if another frame follows.
+bool huffman_decoder_end_frame(HuffmanDecoder* decoder, BitReader reader, bool* more) {
+    unsigned char marker = 0;
+    if (!read_byte(reader, &marker) || marker != 0xFF) return false;
+    if (reader.read_bit == memory_read_bit) {
+        BitReaderMemoryUserdata* bits = (BitReaderMemoryUserdata*)reader.userdata;
+        bits->bit_offset = (bits->bit_offset + 7) / 8 * 8;
+        *more = bits->bit_offset < bits->len*8;
+    }
+    else {
+        HuffmanFrameReader* frame = (HuffmanFrameReader*)reader.userdata;
+        while (frame->bit_offset % 8) {
+            bool bit = false;
+            if (!huffman_frame_read_bit(frame, &bit)) return false;
+        }
+        frame->has_peeked = frame->inner.read_bit(frame->inner.userdata, &frame->peeked);
+        *more = frame->has_peeked;
+    }
+    huffman_decoder_start_frame(decoder);
+    return true;
+}
+
+// Whether arena_realloc can grow old to new_size without running out: in place
+// within the committed pages if old is the last allocation, otherwise as a new
+// allocation from the reserved ones
+bool huffman_arena_can_grow(Arena* arena, void* old, size_t old_size, size_t new_size) {
+    if ((unsigned char*)old + old_size == arena->memory + arena->offset
+        && new_size - old_size <= (size_t)(arena->length - arena->offset)) return true;
+    // Alignment and sanitizer separation take a little more
+    return new_size + 64 <= (size_t)(arena->reserved_length - arena->offset);
+}
+
+char* huffman_decoder_read(HuffmanDecoder* decoder, Arena* arena, BitReader reader, size_t* len, bool* ok) {
+    huffman_decoder_reset(decoder);
+    HuffmanFrameReader frame_reader = {.inner = reader};
+    if (reader.read_bit != memory_read_bit) {
+        reader = (BitReader){
+            .read_bit = huffman_frame_read_bit,
+            .userdata = &frame_reader,
+        };
+    }
+    // One spare byte keeps the buffer a non-empty allocation to grow from
+    char* buffer = arena_alloc_ex(arena, 1, 0, 1, 1);
+    size_t capacity = 1;
+    size_t length = 0;
+    *ok = true;
+    bool more = true;
+    while (*ok && more) {
+        size_t block_len = 0;
+        if (!huffman_decoder_read_block_header(decoder, reader, &block_len)) {
+            *ok = false;
+            break;
+        }
+        size_t block_bytes = block_len*huffman_decoder_symbol_size(decoder) + 1;
+        if (length + block_bytes + 1 > capacity) {
+            // A damaged length fails here rather than running the arena out
+            if (!huffman_arena_can_grow(arena, buffer, capacity, length + block_bytes + 1)) {
+                *ok = false;
+                break;
+            }
+            // Grows in place as long as nothing else allocates from the arena
+            buffer = arena_realloc(arena, buffer, capacity, length + block_bytes + 1);
+            capacity = length + block_bytes + 1;
+        }
+        if (!huffman_decoder_read_block(decoder, reader, (unsigned char*)buffer + length, block_len, &block_bytes)) {
+            *ok = false;
+            break;
+        }
+        length += block_bytes;
+        if (decoder->flags & HUFFMAN_BLOCK_LAST) *ok = huffman_decoder_end_frame(decoder, reader, &more);
+    }
+    *len = length;
+    return buffer;
+}
+
+[[nodiscard]] bool huffman_decoder_decompress(HuffmanDecoder* decoder, const unsigned char* in, size_t in_len, char* out, size_t out_capacity, size_t* out_len) {
+    huffman_decoder_reset(decoder);
+    decoder->bits = (BitReaderMemoryUserdata){
+        .data = in,
+        .len = in_len,
+    };
+    BitReader reader = {
+        .read_bit = memory_read_bit,
+        .userdata = &decoder->bits,
+    };
+    size_t length = 0;
+    bool more = true;
+    while (more) {
+        size_t block_len = 0;
+        if (!huffman_decoder_read_block_header(decoder, reader, &block_len)) return false;
+        size_t block_bytes = block_len*huffman_decoder_symbol_size(decoder);
+        if (decoder->flags & HUFFMAN_BLOCK_TRAILING_BYTE) block_bytes += 1;
+        if (block_bytes > out_capacity - length) return false;
+        if (!huffman_decoder_read_block(decoder, reader, (unsigned char*)out + length, block_len, &block_bytes)) return false;
+        length += block_bytes;
+        if ((decoder->flags & HUFFMAN_BLOCK_LAST) && !huffman_decoder_end_frame(decoder, reader, &more)) return false;
+    }
+    *out_len = length;
+    return true;
+}
+
+typedef enum {
+    HUFFMAN_PUSH_ADVANCED,
+    HUFFMAN_PUSH_STALLED_INPUT,
+    HUFFMAN_PUSH_STALLED_OUTPUT,
+    HUFFMAN_PUSH_FAILED,
+} HuffmanPushProgress;
+
+void huffman_decoder_push_symbols_done(HuffmanDecoder* decoder) {
+    HuffmanPushDecoder* push = decoder->push;
+    if (decoder->flags & HUFFMAN_BLOCK_ADAPTIVE_TABLE) {
+        huffman_histogram_sort(decoder->histogram);
+        huffman_model_update(decoder->model, decoder->histogram);
+    }
+    if (decoder->flags & HUFFMAN_BLOCK_TRAILING_BYTE) push->step = HUFFMAN_PUSH_STEP_TRAILING_BYTE;
+    else if (decoder->flags & HUFFMAN_BLOCK_LAST) push->step = HUFFMAN_PUSH_STEP_END_MARKER;
+    else push->step = HUFFMAN_PUSH_STEP_BLOCK_FLAGS;
+}
+
+// Moves the decoder one step on with the input buffered so far. A unit that
+// is not complete yet is left unread.
+HuffmanPushProgress huffman_decoder_push_step(HuffmanDecoder* decoder, unsigned char* out, size_t out_capacity, size_t* out_len) {
+    HuffmanPushDecoder* push = decoder->push;
+    BitReaderMemoryUserdata* bits = &decoder->bits;
+    BitReader reader = {
+        .read_bit = memory_read_bit,
+        .userdata = bits,
+    };
+    size_t available = bits->len*8 - bits->bit_offset;
+    size_t symbol_size = huffman_decoder_symbol_size(decoder);
+    size_t alphabet_size = huffman_alphabet_size(symbol_size);
+    switch (push->step) {
+    case HUFFMAN_PUSH_STEP_FRAME_HEADER: {
+        if (available < 8*HUFFMAN_FRAME_HEADER_SIZE) return HUFFMAN_PUSH_STALLED_INPUT;
+        // Frames of the first version are only read by the pull decoders
+        unsigned char first = 0;
+        read_byte(reader, &first);
+        if (!huffman_decoder_check_frame_header(reader, first)) return HUFFMAN_PUSH_FAILED;
+        decoder->in_frame = true;
+        push->step = HUFFMAN_PUSH_STEP_BLOCK_FLAGS;
+        return HUFFMAN_PUSH_ADVANCED;
+    }
+    case HUFFMAN_PUSH_STEP_BLOCK_FLAGS: {
+        if (available < 8) return HUFFMAN_PUSH_STALLED_INPUT;
+        read_byte(reader, &decoder->flags);
+        if (!huffman_decoder_reserve_alphabet(decoder, huffman_alphabet_size(huffman_decoder_symbol_size(decoder)))) return HUFFMAN_PUSH_FAILED;
+        push->step = huffman_decoder_prepare_table(decoder) ? HUFFMAN_PUSH_STEP_BLOCK_LENGTH : HUFFMAN_PUSH_STEP_TABLE_HEADER;
+        return HUFFMAN_PUSH_ADVANCED;
+    }
+    case HUFFMAN_PUSH_STEP_TABLE_HEADER: {
+        if (available < 8 + 17) return HUFFMAN_PUSH_STALLED_INPUT;
+        if (decoder->flags & HUFFMAN_BLOCK_ANS) {
+            if (!read_ans_table_header(decoder->ans_table, reader, alphabet_size, &push->entries_left)) return HUFFMAN_PUSH_FAILED;
+        }
+        else {
+            if (!read_huffman_table_header(decoder->table, reader, alphabet_size, &push->nobfel, &push->entries_left)) return HUFFMAN_PUSH_FAILED;
+        }
+        push->previous_symbol = 0;
+        push->step = HUFFMAN_PUSH_STEP_TABLE_ENTRY;
+        return HUFFMAN_PUSH_ADVANCED;
+    }
+    case HUFFMAN_PUSH_STEP_TABLE_ENTRY: {
+        bool ans = decoder->flags & HUFFMAN_BLOCK_ANS;
+        while (push->entries_left > 0) {
+            size_t entry_start = bits->bit_offset;
+            bool read = ans
+                ? read_ans_table_entry(decoder->ans_table, reader, &push->previous_symbol)
+                : read_huffman_table_entry(decoder->table, reader, push->nobfel, &push->previous_symbol);
+            if (!read) {
+                if (bits->bit_offset < bits->len*8) return HUFFMAN_PUSH_FAILED;
+                bits->bit_offset = entry_start;
+                return HUFFMAN_PUSH_STALLED_INPUT;
+            }
+            push->entries_left -= 1;
+        }
+        if (ans) {
+            if (!huffman_ans_table_check(decoder->ans_table)) return HUFFMAN_PUSH_FAILED;
+            huffman_ans_decode_table_build(decoder->scratch, decoder->ans_decode_table, decoder->ans_table);
+        }
+        else {
+            if (!huffman_table_assign_codes(decoder->table)) return HUFFMAN_PUSH_FAILED;
+            huffman_decoder_use_transmitted_table(decoder);
+        }
+        push->step = HUFFMAN_PUSH_STEP_BLOCK_LENGTH;
+        return HUFFMAN_PUSH_ADVANCED;
+    }
+    case HUFFMAN_PUSH_STEP_BLOCK_LENGTH: {
+        if (available < 32) return HUFFMAN_PUSH_STALLED_INPUT;
+        push->symbols_left = read_encoded_message_length(reader);
+        if (!huffman_decoder_check_block(decoder, push->symbols_left)) return HUFFMAN_PUSH_FAILED;
+        if (decoder->flags & HUFFMAN_BLOCK_ADAPTIVE_TABLE) huffman_histogram_clear(decoder->histogram, alphabet_size);
+        push->step = (decoder->flags & HUFFMAN_BLOCK_ANS) ? HUFFMAN_PUSH_STEP_ANS_STATE : HUFFMAN_PUSH_STEP_SYMBOLS;
+        return HUFFMAN_PUSH_ADVANCED;
+    }
+    case HUFFMAN_PUSH_STEP_ANS_STATE: {
+        if (available < 2*HUFFMAN_ANS_TABLE_LOG) return HUFFMAN_PUSH_STALLED_INPUT;
+        huffman_decoder_read_ans_states(reader, push->ans_states);
+        push->step = HUFFMAN_PUSH_STEP_SYMBOLS;
+        return HUFFMAN_PUSH_ADVANCED;
+    }
+    case HUFFMAN_PUSH_STEP_SYMBOLS: {
+        const HuffmanKernels* kernels = huffman_kernels();
+        size_t max_bits = huffman_decoder_max_symbol_bits(decoder);
+        bool adaptive = decoder->flags & HUFFMAN_BLOCK_ADAPTIVE_TABLE;
+        while (push->symbols_left > 0) {
+            if (*out_len == out_capacity) return HUFFMAN_PUSH_STALLED_OUTPUT;
+            // As many codes as the buffered bits are sure to hold
+            size_t n = push->symbols_left;
+            size_t space = (out_capacity - *out_len) / symbol_size;
+            if (n > space) n = space;
+            size_t available_codes = (bits->len*8 - bits->bit_offset) / max_bits;
+            if (n > available_codes) n = available_codes;
+            if (n > 0) {
+                if (!huffman_decoder_decode_symbols(decoder, bits, out + *out_len, n, push->ans_states)) return HUFFMAN_PUSH_FAILED;
+                if (adaptive) kernels->histogram(out + *out_len, n, symbol_size, decoder->histogram);
+                *out_len += n*symbol_size;
+                push->symbols_left -= n;
+                continue;
+            }
+            // A single code that may be cut off, or a symbol wider than the room left
+            unsigned char symbol[HUFFMAN_MAX_SYMBOL_SIZE];
+            BitReaderMemoryUserdata probe = *bits;
+            uint32_t probe_states[2] = {push->ans_states[0], push->ans_states[1]};
+            if (!huffman_decoder_decode_symbols(decoder, &probe, symbol, 1, probe_states)) {
+                if (bits->bit_offset + max_bits <= bits->len*8) return HUFFMAN_PUSH_FAILED;
+                return HUFFMAN_PUSH_STALLED_INPUT;
+            }
+            *bits = probe;
+            memcpy(push->ans_states, probe_states, sizeof(probe_states));
+            if (adaptive) kernels->histogram(symbol, 1, symbol_size, decoder->histogram);
+            push->symbols_left -= 1;
+            size_t fit = out_capacity - *out_len < symbol_size ? out_capacity - *out_len : symbol_size;
+            memcpy(out + *out_len, symbol, fit);
+            *out_len += fit;
+            memcpy(push->pending, symbol + fit, symbol_size - fit);
+            push->pending_len = symbol_size - fit;
+            push->pending_offset = 0;
+            if (push->pending_len) break;
+        }
+        if (push->symbols_left == 0) {
+            bool ans_intact = push->ans_states[0] == 0 && push->ans_states[1] == 0;
+            if ((decoder->flags & HUFFMAN_BLOCK_ANS) && !ans_intact) return HUFFMAN_PUSH_FAILED;
+            huffman_decoder_push_symbols_done(decoder);
+        }
+        return push->pending_len ? HUFFMAN_PUSH_STALLED_OUTPUT : HUFFMAN_PUSH_ADVANCED;
+    }
+    case HUFFMAN_PUSH_STEP_TRAILING_BYTE: {
+        if (available < 8) return HUFFMAN_PUSH_STALLED_INPUT;
+        if (*out_len == out_capacity) return HUFFMAN_PUSH_STALLED_OUTPUT;
+        read_byte(reader, &out[(*out_len)++]);
+        push->step = (decoder->flags & HUFFMAN_BLOCK_LAST) ? HUFFMAN_PUSH_STEP_END_MARKER : HUFFMAN_PUSH_STEP_BLOCK_FLAGS;
+        return HUFFMAN_PUSH_ADVANCED;
+    }
+    case HUFFMAN_PUSH_STEP_END_MARKER: {
+        if (available < 8) return HUFFMAN_PUSH_STALLED_INPUT;
+        unsigned char marker = 0;
+        read_byte(reader, &marker);
+        if (marker != 0xFF) return HUFFMAN_PUSH_FAILED;
+        // The writer pads the last byte
+        bits->bit_offset = (bits->bit_offset + 7) / 8 * 8;
+        push->step = HUFFMAN_PUSH_STEP_FINISHED;
+        return HUFFMAN_PUSH_ADVANCED;
+    }
+    case HUFFMAN_PUSH_STEP_FINISHED:
+    case HUFFMAN_PUSH_STEP_FAILED:
+        break;
+    }
+    return HUFFMAN_PUSH_FAILED;
+}
+
+// Hands back the unread bytes staged during this call, the caller passes them
+// again next time. Bytes staged before are never past the end of the message.
+void huffman_decoder_push_unstage(HuffmanDecoder* decoder, size_t* staged, size_t* in_consumed) {
+    BitReaderMemoryUserdata* bits = &decoder->bits;
+    size_t unread = bits->len - (bits->bit_offset + 7)/8;
+    if (unread > *staged) unread = *staged;
+    bits->len -= unread;
+    *staged -= unread;
+    *in_consumed -= unread;
+}
+
+HuffmanPushStatus huffman_decoder_push(HuffmanDecoder* decoder, const unsigned char* in, size_t in_len, size_t* in_consumed, char* out_chars, size_t out_capacity, size_t* out_len) {
+    unsigned char* out = (unsigned char*)out_chars;
+    *in_consumed = 0;
+    *out_len = 0;
+    if (!decoder->push) {
+        if (!huffman_arena_has_room(&decoder->scratch, sizeof(HuffmanPushDecoder) + HUFFMAN_PUSH_BUFFER_SIZE, 2)) return HUFFMAN_PUSH_ERROR;
+        decoder->push = arena_new(&decoder->scratch, HuffmanPushDecoder, 1);
+        decoder->push->buffer = arena_alloc_ex(&decoder->scratch, HUFFMAN_PUSH_BUFFER_SIZE, 0, 1, 1);
+    }
+    HuffmanPushDecoder* push = decoder->push;
+    if (!push->started) {
+        // Whole-message decoding leaves its input and frame state behind
+        huffman_decoder_reset(decoder);
+        push->started = true;
+    }
+    BitReaderMemoryUserdata* bits = &decoder->bits;
+    bits->data = push->buffer;
+    size_t staged = 0;
+    while (true) {
+        while (push->pending_offset < push->pending_len && *out_len < out_capacity) {
+            out[(*out_len)++] = push->pending[push->pending_offset++];
+        }
+        if (push->pending_offset < push->pending_len) {
+            huffman_decoder_push_unstage(decoder, &staged, in_consumed);
+            return HUFFMAN_PUSH_NEED_OUTPUT;
+        }
+        push->pending_len = push->pending_offset = 0;
+        if (push->step == HUFFMAN_PUSH_STEP_FAILED) return HUFFMAN_PUSH_ERROR;
+        if (push->step == HUFFMAN_PUSH_STEP_FINISHED) {
+            // Input past the end of the message belongs to the caller
+            huffman_decoder_push_unstage(decoder, &staged, in_consumed);
+            return HUFFMAN_PUSH_DONE;
+        }
+
+        size_t consumed_bytes = bits->bit_offset / 8;
+        memmove(push->buffer, push->buffer + consumed_bytes, bits->len - consumed_bytes);
+        bits->len -= consumed_bytes;
+        bits->bit_offset -= consumed_bytes*8;
+        size_t take = in_len - *in_consumed;
+        if (take > HUFFMAN_PUSH_BUFFER_SIZE - bits->len) take = HUFFMAN_PUSH_BUFFER_SIZE - bits->len;
+        memcpy(push->buffer + bits->len, in + *in_consumed, take);
+        bits->len += take;
+        *in_consumed += take;
+        staged += take;
+
+        switch (huffman_decoder_push_step(decoder, out, out_capacity, out_len)) {
+        case HUFFMAN_PUSH_ADVANCED:
+            break;
+        case HUFFMAN_PUSH_STALLED_INPUT:
+            if (*in_consumed == in_len) return HUFFMAN_PUSH_NEED_INPUT;
+            break;
+        case HUFFMAN_PUSH_STALLED_OUTPUT:
+            if (push->pending_len) break;
+            huffman_decoder_push_unstage(decoder, &staged, in_consumed);
+            return HUFFMAN_PUSH_NEED_OUTPUT;
+        case HUFFMAN_PUSH_FAILED:
+            push->step = HUFFMAN_PUSH_STEP_FAILED;
+            return HUFFMAN_PUSH_ERROR;
+        }
+    }
+}
+
+// Byte tables, a legacy tree and a tANS decode table fit with room to spare.
+// 16-bit messages need a HuffmanDecoder with more scratch.
+#define HUFFMAN_READ_SCRATCH_SIZE (1<<18)
+
+char* huffman_read(Arena* arena, BitReader reader, size_t* len, bool* ok) {
+    // Borrow the top of the caller's free space as scratch, out of the way of
+    // the output growing in place at the bottom, and hand it back afterwards
+    ptrdiff_t scratch_size = HUFFMAN_READ_SCRATCH_SIZE;
+    if (!huffman_arena_has_room(arena, scratch_size, 1)) {
+        *ok = false;
+        return 0;
+    }
+    ptrdiff_t top = arena->reserved_length - scratch_size;
+    ptrdiff_t length = arena->length;
+    Arena scratch = {
+        .memory = arena->memory + top,
+        .length = length > top ? length - top : 0,
+        .reserved_length = scratch_size,
+        .page_size = arena->page_size,
+    };
+    arena->reserved_length = top;
+    if (arena->length > top) arena->length = top;
+    HuffmanDecoder decoder = {0};
+    char* buffer = 0;
+    *ok = huffman_decoder_setup(&decoder, scratch);
+    if (*ok) buffer = huffman_decoder_read(&decoder, arena, reader, len, ok);
+    ARENA_ASAN_POISON(scratch.memory, scratch_size);
+    arena->reserved_length = top + scratch_size;
+    if (arena->length < length) arena->length = length;
     return buffer;
 }
 
@@ -0,0 +1,422 @@
+// Hot loops of huffman.h. This file is included once per instruction set
+// variant, with HUFFMAN_KERNEL_SUFFIX naming the variant and
+// HUFFMAN_KERNEL_ATTRIBUTES selecting its target, so every variant is compiled
+// from the same source. HUFFMAN_KERNEL_BMI2 adds the paths that need BMI2 and
+// MOVBE intrinsics. No include guard on purpose.
+#ifndef HUFFMAN_KERNEL_SUFFIX
+    #error "Define HUFFMAN_KERNEL_SUFFIX before including huffman_kernels.h"
+#endif
+#ifndef HUFFMAN_KERNEL_ATTRIBUTES
+    #define HUFFMAN_KERNEL_ATTRIBUTES
+#endif
+
+#define HUFFMAN_KERNEL_IMPL_CONCAT(name, suffix) name##_##suffix
+#define HUFFMAN_KERNEL_IMPL_NAME(name, suffix) HUFFMAN_KERNEL_IMPL_CONCAT(name, suffix)
+#define HUFFMAN_KERNEL(name) HUFFMAN_KERNEL_IMPL_NAME(name, HUFFMAN_KERNEL_SUFFIX)
+
+// Adds to the counts and appends the symbols not counted before to the symbol
+// list, in order of appearance, so nobody has to scan the whole alphabet
+HUFFMAN_KERNEL_ATTRIBUTES
+void HUFFMAN_KERNEL(huffman_histogram_kernel)(const unsigned char* msg, size_t symbol_count, size_t symbol_size, HuffmanHistogram* histogram) {
+    int64_t* frequencies = histogram->frequencies;
+    uint16_t* symbols = histogram->symbols;
+    size_t listed = histogram->symbol_count;
+    if (symbol_size == 2) {
+        for (size_t i = 0; i < symbol_count; i++) {
+            uint16_t symbol = msg[2*i] | ((uint16_t)msg[2*i+1] << 8);
+            if (!frequencies[symbol]) symbols[listed++] = symbol;
+            frequencies[symbol] += 1;
+        }
+        histogram->symbol_count = listed;
+        return;
+    }
+    // Four tables so runs of one byte do not wait on their own increments
+    uint32_t counts[4][256] = {0};
+    while (symbol_count > 0) {
+        // Chunks keep the 32-bit counts from overflowing
+        size_t chunk = symbol_count < ((size_t)1<<30) ? symbol_count : ((size_t)1<<30);
+        size_t i = 0;
+        for (; i + 4 <= chunk; i += 4) {
+            counts[0][msg[i+0]] += 1;
+            counts[1][msg[i+1]] += 1;
+            counts[2][msg[i+2]] += 1;
+            counts[3][msg[i+3]] += 1;
+        }
+        for (; i < chunk; i++) {
+            counts[0][msg[i]] += 1;
+        }
+        for (size_t s = 0; s < 256; s++) {
+            int64_t count = (int64_t)counts[0][s] + counts[1][s] + counts[2][s] + counts[3][s];
+            if (count && !frequencies[s]) symbols[listed++] = (uint16_t)s;
+            frequencies[s] += count;
+            counts[0][s] = counts[1][s] = counts[2][s] = counts[3][s] = 0;
+        }
+        msg += chunk;
+        symbol_count -= chunk;
+    }
+    histogram->symbol_count = listed;
+}
+
+// Stores the whole bytes of the accumulator with a full 8 byte store, the next
+// store overwrites the bytes past them
+HUFFMAN_KERNEL_ATTRIBUTES
+static inline void HUFFMAN_KERNEL(huffman_store_kernel)(unsigned char* data, uint64_t acc, size_t acc_bits) {
+    uint64_t word = acc << (64 - acc_bits);
+#ifdef HUFFMAN_KERNEL_BMI2
+    // Byte swapped loads and stores compile to MOVBE
+    word = __builtin_bswap64(word);
+    memcpy(data, &word, sizeof(word));
+#else
+    data[0] = (unsigned char)(word >> 56);
+    data[1] = (unsigned char)(word >> 48);
+    data[2] = (unsigned char)(word >> 40);
+    data[3] = (unsigned char)(word >> 32);
+    data[4] = (unsigned char)(word >> 24);
+    data[5] = (unsigned char)(word >> 16);
+    data[6] = (unsigned char)(word >> 8);
+    data[7] = (unsigned char)(word >> 0);
+#endif
+}
+
+// Packs codes into a 64-bit accumulator and stores its whole bytes after every
+// code, so the loop has no branch on the bit count. The last bytes before the
+// end of the output go one at a time. Partial bytes are picked up from and
+// left in the writer's bit buffer.
+HUFFMAN_KERNEL_ATTRIBUTES
+bool HUFFMAN_KERNEL(huffman_encode_kernel)(const HuffmanTableEntry* entries, const unsigned char* msg, size_t symbol_count, size_t symbol_size, BitWriterMemoryUserdata* out) {
+    uint64_t acc = 0;
+    size_t acc_bits = out->cursor;
+    for (size_t i = 0; i < out->cursor; i++) {
+        acc = (acc << 1) | out->buffer[i];
+    }
+    unsigned char* data = out->data;
+    size_t len = out->len;
+    size_t capacity = out->capacity;
+    size_t i = 0;
+    // acc_bits stays below 8 between codes, so a 32 bit code fits
+    if (symbol_size == 2) {
+        for (; i < symbol_count && capacity - len >= 8; i++) {
+            HuffmanTableEntry entry = entries[msg[2*i] | ((uint32_t)msg[2*i+1] << 8)];
+            acc = (acc << entry.len) | entry.code;
+            acc_bits += entry.len;
+            HUFFMAN_KERNEL(huffman_store_kernel)(data + len, acc, acc_bits);
+            len += acc_bits / 8;
+            acc_bits %= 8;
+        }
+    }
+    else {
+        uint32_t max_len = 0;
+        for (size_t symbol = 0; symbol < 256; symbol++) {
+            if (entries[symbol].len > max_len) max_len = entries[symbol].len;
+        }
+        // Two codes of at most 28 bits fit next to the 7 bits left over
+        if (max_len <= 28) {
+            for (; i + 2 <= symbol_count && capacity - len >= 8; i += 2) {
+                HuffmanTableEntry first = entries[msg[i]];
+                HuffmanTableEntry second = entries[msg[i+1]];
+                acc = (acc << first.len) | first.code;
+                acc = (acc << second.len) | second.code;
+                acc_bits += first.len + second.len;
+                HUFFMAN_KERNEL(huffman_store_kernel)(data + len, acc, acc_bits);
+                len += acc_bits / 8;
+                acc_bits %= 8;
+            }
+        }
+        for (; i < symbol_count && capacity - len >= 8; i++) {
+            HuffmanTableEntry entry = entries[msg[i]];
+            acc = (acc << entry.len) | entry.code;
+            acc_bits += entry.len;
+            HUFFMAN_KERNEL(huffman_store_kernel)(data + len, acc, acc_bits);
+            len += acc_bits / 8;
+            acc_bits %= 8;
+        }
+    }
+    for (; i < symbol_count; i++) {
+        uint32_t symbol = symbol_size == 2 ? (msg[2*i] | ((uint32_t)msg[2*i+1] << 8)) : msg[i];
+        HuffmanTableEntry entry = entries[symbol];
+        acc = (acc << entry.len) | entry.code;
+        acc_bits += entry.len;
+        while (acc_bits >= 8) {
+            acc_bits -= 8;
+            if (len >= capacity) return false;
+            data[len++] = (unsigned char)(acc >> acc_bits);
+        }
+    }
+    for (size_t i = 0; i < acc_bits; i++) {
+        out->buffer[i] = (acc >> (acc_bits-1-i)) & 1;
+    }
+    out->cursor = acc_bits;
+    out->len = len;
+    return true;
+}
+
+// Next 64 bits from bit_offset, most significant first, zero past the end.
+// At least 57 of them are valid input.
+HUFFMAN_KERNEL_ATTRIBUTES
+static inline uint64_t HUFFMAN_KERNEL(huffman_refill_kernel)(const unsigned char* data, size_t len, size_t bit_offset) {
+    size_t byte_offset = bit_offset / 8;
+    uint64_t bits = 0;
+    if (byte_offset + 8 <= len) {
+#ifdef HUFFMAN_KERNEL_BMI2
+        memcpy(&bits, data + byte_offset, sizeof(bits));
+        return __builtin_bswap64(bits) << (bit_offset % 8);
+#else
+        for (size_t i = 0; i < 8; i++) {
+            bits = (bits << 8) | data[byte_offset+i];
+        }
+#endif
+    }
+    else {
+        for (size_t i = 0; i < 8; i++) {
+            bits = (bits << 8) | (byte_offset+i < len ? data[byte_offset+i] : 0);
+        }
+    }
+    return bits << (bit_offset % 8);
+}
+
+// Length of the code at the top of bits, 0 if it is not a code of the table
+HUFFMAN_KERNEL_ATTRIBUTES
+static inline size_t HUFFMAN_KERNEL(huffman_lookup_kernel)(const HuffmanDecodeTable* table, uint64_t bits, uint32_t* symbol) {
+    HuffmanLookupEntry entry = table->lookup[bits >> (64 - HUFFMAN_LOOKUP_BITS)];
+    *symbol = entry.symbol;
+    if (entry.len) return entry.len;
+    if (table->legacy_tree) {
+        // Legacy codes are not canonical, walk the tree from the lookup's node
+        const HuffmanLegacyNode* nodes = table->legacy_tree->nodes;
+        size_t node = entry.symbol;
+        for (size_t code_len = HUFFMAN_LOOKUP_BITS+1; node && code_len <= table->max_len; code_len++) {
+            node = nodes[node].child[(bits >> (64 - code_len)) & 1];
+            if (node && nodes[node].symbol >= 0) {
+                *symbol = (uint32_t)nodes[node].symbol;
+                return code_len;
+            }
+        }
+        return 0;
+    }
+    // Longer than the lookup, walk the canonical code lengths
+    for (size_t code_len = HUFFMAN_LOOKUP_BITS+1; code_len <= table->max_len; code_len++) {
+        uint64_t index = (bits >> (64 - code_len)) - table->first_code[code_len];
+        if (index < table->count[code_len]) {
+            *symbol = table->symbols[table->offset[code_len] + index];
+            return code_len;
+        }
+    }
+    return 0;
+}
+
+HUFFMAN_KERNEL_ATTRIBUTES
+bool HUFFMAN_KERNEL(huffman_decode_kernel)(const HuffmanDecodeTable* table, BitReaderMemoryUserdata* in, unsigned char* out, size_t symbol_count, size_t symbol_size) {
+    const unsigned char* data = in->data;
+    size_t len = in->len;
+    size_t bit_offset = in->bit_offset;
+    uint64_t bits = HUFFMAN_KERNEL(huffman_refill_kernel)(data, len, bit_offset);
+    size_t available = 56;
+    for (size_t i = 0; i < symbol_count; i++) {
+        if (available < HUFFMAN_MAX_CODE_LEN) {
+            bits = HUFFMAN_KERNEL(huffman_refill_kernel)(data, len, bit_offset);
+            available = 56;
+        }
+        uint32_t symbol = 0;
+        size_t code_len = HUFFMAN_KERNEL(huffman_lookup_kernel)(table, bits, &symbol);
+        if (!code_len) return false;
+        bits <<= code_len;
+        available -= code_len;
+        bit_offset += code_len;
+        if (symbol_size == 2) {
+            out[2*i] = symbol & 0xFF;
+            out[2*i+1] = symbol >> 8;
+        }
+        else {
+            out[i] = (unsigned char)symbol;
+        }
+    }
+    // Codes that ran into the zero padding past the end
+    if (bit_offset > len*8) return false;
+    in->bit_offset = bit_offset;
+    return true;
+}
+
+// Decodes the codes from bit_offset until one ends at or past end_bit. The
+// offsets of the first boundary_capacity codes are kept. out needs room for a
+// symbol per shortest code length of bits in the range, plus one. False if the
+// bits stop being codes of the table or run past the data.
+HUFFMAN_KERNEL_ATTRIBUTES
+bool HUFFMAN_KERNEL(huffman_scan_kernel)(const HuffmanDecodeTable* table, const unsigned char* data, size_t len, size_t bit_offset, size_t end_bit, size_t* boundaries, size_t boundary_capacity, unsigned char* out, size_t symbol_size, size_t* exit_bit, size_t* symbol_count) {
+    if (end_bit > len*8) end_bit = len*8;
+    uint64_t bits = HUFFMAN_KERNEL(huffman_refill_kernel)(data, len, bit_offset);
+    size_t available = 56;
+    size_t count = 0;
+    bool ok = true;
+    while (bit_offset < end_bit) {
+        if (count < boundary_capacity) boundaries[count] = bit_offset;
+        if (available < HUFFMAN_MAX_CODE_LEN) {
+            bits = HUFFMAN_KERNEL(huffman_refill_kernel)(data, len, bit_offset);
+            available = 56;
+        }
+        uint32_t symbol = 0;
+        size_t code_len = HUFFMAN_KERNEL(huffman_lookup_kernel)(table, bits, &symbol);
+        if (!code_len) {
+            ok = false;
+            break;
+        }
+        bits <<= code_len;
+        available -= code_len;
+        bit_offset += code_len;
+        if (symbol_size == 2) {
+            out[2*count] = symbol & 0xFF;
+            out[2*count+1] = symbol >> 8;
+        }
+        else {
+            out[count] = (unsigned char)symbol;
+        }
+        count += 1;
+    }
+    *exit_bit = bit_offset;
+    *symbol_count = count;
+    return ok && bit_offset <= len*8;
+}
+
+// Bits a tANS state sheds before taking on the symbol, as value << 8 | count
+HUFFMAN_KERNEL_ATTRIBUTES
+static inline uint32_t HUFFMAN_KERNEL(huffman_ans_step_kernel)(const HuffmanAnsTransform* transforms, const uint16_t* states, uint32_t symbol, uint32_t* state) {
+    HuffmanAnsTransform transform = transforms[symbol];
+    uint32_t bit_count = (uint32_t)((int32_t)*state + transform.delta_bits) >> 16;
+#ifdef HUFFMAN_KERNEL_BMI2
+    uint32_t chunk = (_bzhi_u32(*state, bit_count) << 8) | bit_count;
+#else
+    uint32_t chunk = ((*state & ((1u << bit_count) - 1)) << 8) | bit_count;
+#endif
+    *state = states[(*state >> bit_count) + transform.delta_state];
+    return chunk;
+}
+
+// tANS codes the symbols last to first so that the decoder runs first to last.
+// Even and odd symbols go through two states, whose updates overlap. The bits
+// of each symbol are kept in chunks for huffman_pack_kernel to store in order.
+// Returns the states the decoder starts from, the one of the first symbol first.
+HUFFMAN_KERNEL_ATTRIBUTES
+void HUFFMAN_KERNEL(huffman_ans_encode_kernel)(const HuffmanAnsTransform* transforms, const uint16_t* states, const unsigned char* msg, size_t symbol_count, size_t symbol_size, uint32_t* chunks, uint32_t* final_states) {
+    uint32_t even = HUFFMAN_ANS_STATES;
+    uint32_t odd = HUFFMAN_ANS_STATES;
+    size_t i = symbol_count;
+    if (symbol_size == 2) {
+        if (i & 1) {
+            i -= 1;
+            chunks[i] = HUFFMAN_KERNEL(huffman_ans_step_kernel)(transforms, states, msg[2*i] | ((uint32_t)msg[2*i+1] << 8), &even);
+        }
+        while (i >= 2) {
+            i -= 2;
+            chunks[i+1] = HUFFMAN_KERNEL(huffman_ans_step_kernel)(transforms, states, msg[2*i+2] | ((uint32_t)msg[2*i+3] << 8), &odd);
+            chunks[i] = HUFFMAN_KERNEL(huffman_ans_step_kernel)(transforms, states, msg[2*i] | ((uint32_t)msg[2*i+1] << 8), &even);
+        }
+    }
+    else {
+        if (i & 1) {
+            i -= 1;
+            chunks[i] = HUFFMAN_KERNEL(huffman_ans_step_kernel)(transforms, states, msg[i], &even);
+        }
+        while (i >= 2) {
+            i -= 2;
+            chunks[i+1] = HUFFMAN_KERNEL(huffman_ans_step_kernel)(transforms, states, msg[i+1], &odd);
+            chunks[i] = HUFFMAN_KERNEL(huffman_ans_step_kernel)(transforms, states, msg[i], &even);
+        }
+    }
+    final_states[0] = even;
+    final_states[1] = odd;
+}
+
+// Stores chunks of at most 24 bits 32 bits at a time. Chunks may be empty,
+// which rules out the store after every code of huffman_encode_kernel.
+HUFFMAN_KERNEL_ATTRIBUTES
+bool HUFFMAN_KERNEL(huffman_pack_kernel)(const uint32_t* chunks, size_t chunk_count, BitWriterMemoryUserdata* out) {
+    uint64_t acc = 0;
+    size_t acc_bits = out->cursor;
+    for (size_t i = 0; i < out->cursor; i++) {
+        acc = (acc << 1) | out->buffer[i];
+    }
+    unsigned char* data = out->data;
+    size_t len = out->len;
+    size_t capacity = out->capacity;
+    for (size_t i = 0; i < chunk_count; i++) {
+        uint32_t bit_count = chunks[i] & 0xFF;
+        acc = (acc << bit_count) | (chunks[i] >> 8);
+        acc_bits += bit_count;
+        if (acc_bits >= 32) {
+            acc_bits -= 32;
+            if (capacity - len < 4) return false;
+            uint32_t word = (uint32_t)(acc >> acc_bits);
+#ifdef HUFFMAN_KERNEL_BMI2
+            word = __builtin_bswap32(word);
+            memcpy(data + len, &word, sizeof(word));
+#else
+            data[len+0] = (unsigned char)(word >> 24);
+            data[len+1] = (unsigned char)(word >> 16);
+            data[len+2] = (unsigned char)(word >> 8);
+            data[len+3] = (unsigned char)(word >> 0);
+#endif
+            len += 4;
+        }
+    }
+    while (acc_bits >= 8) {
+        acc_bits -= 8;
+        if (len >= capacity) return false;
+        data[len++] = (unsigned char)(acc >> acc_bits);
+    }
+    for (size_t i = 0; i < acc_bits; i++) {
+        out->buffer[i] = (acc >> (acc_bits-1-i)) & 1;
+    }
+    out->cursor = acc_bits;
+    out->len = len;
+    return true;
+}
+
+// Every state is valid, so this only fails when the bits run out. The first
+// of the two states decodes the next symbol, they swap after an odd count.
+HUFFMAN_KERNEL_ATTRIBUTES
+bool HUFFMAN_KERNEL(huffman_ans_decode_kernel)(const HuffmanAnsDecodeEntry* table, BitReaderMemoryUserdata* in, unsigned char* out, size_t symbol_count, size_t symbol_size, uint32_t* states) {
+    const unsigned char* data = in->data;
+    size_t len = in->len;
+    size_t bit_offset = in->bit_offset;
+    uint32_t first = states[0];
+    uint32_t second = states[1];
+    uint64_t bits = HUFFMAN_KERNEL(huffman_refill_kernel)(data, len, bit_offset);
+    size_t available = 56;
+    for (size_t i = 0; i < symbol_count; i++) {
+        if (available < HUFFMAN_ANS_TABLE_LOG) {
+            bits = HUFFMAN_KERNEL(huffman_refill_kernel)(data, len, bit_offset);
+            available = 56;
+        }
+        HuffmanAnsDecodeEntry entry = table[first];
+        first = second;
+#ifdef HUFFMAN_KERNEL_BMI2
+        // Rotates the read to the bottom and clears the rest, a count of zero reads nothing
+        uint64_t rotated = (bits << entry.bit_count) | (bits >> (-entry.bit_count & 63));
+        second = entry.base + (uint32_t)_bzhi_u64(rotated, entry.bit_count);
+#else
+        // Two shifts so a count of zero reads nothing
+        second = entry.base + (uint32_t)((bits >> 1) >> (63 - entry.bit_count));
+#endif
+        bits <<= entry.bit_count;
+        available -= entry.bit_count;
+        bit_offset += entry.bit_count;
+        if (symbol_size == 2) {
+            out[2*i] = entry.symbol & 0xFF;
+            out[2*i+1] = entry.symbol >> 8;
+        }
+        else {
+            out[i] = (unsigned char)entry.symbol;
+        }
+    }
+    if (bit_offset > len*8) return false;
+    in->bit_offset = bit_offset;
+    states[0] = first;
+    states[1] = second;
+    return true;
+}
+
+#undef HUFFMAN_KERNEL
+#undef HUFFMAN_KERNEL_IMPL_NAME
+#undef HUFFMAN_KERNEL_IMPL_CONCAT
+#undef HUFFMAN_KERNEL_SUFFIX
+#undef HUFFMAN_KERNEL_ATTRIBUTES
+#undef HUFFMAN_KERNEL_BMI2
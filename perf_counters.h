@@ -0,0 +1,155 @@
+#pragma once
+// syscall() is only declared with the GNU or default extensions, which have to
+// be requested before the first system header of the translation unit
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+    #define _GNU_SOURCE
+#endif
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum {
+    PERF_COUNTER_CYCLES,
+    PERF_COUNTER_INSTRUCTIONS,
+    PERF_COUNTER_BRANCH_MISSES,
+    PERF_COUNTER_L1D_MISSES,
+    PERF_COUNTER_LLC_MISSES,
+    PERF_COUNTER_COUNT,
+} PerfCounterKind;
+
+// Counters that could not be opened (no kernel support, perf_event_paranoid,
+// containers without CAP_PERFMON, non-Linux) stay unavailable, the rest still count.
+// The available ones form one group that the kernel schedules together, so
+// ratios such as instructions per cycle compare counts of the same time span.
+typedef struct {
+    int fds[PERF_COUNTER_COUNT];
+    bool available[PERF_COUNTER_COUNT];
+    uint64_t values[PERF_COUNTER_COUNT];
+} PerfCounters;
+
+bool perf_counters_open(PerfCounters* counters); // Returns false if no counter is available
+void perf_counters_clear(PerfCounters* counters);
+void perf_counters_start(PerfCounters* counters);
+void perf_counters_stop(PerfCounters* counters); // Adds the counts since start to values
+void perf_counters_close(PerfCounters* counters);
+
+#ifdef PERF_COUNTERS_IMPLEMENTATION
+
+#ifdef __linux__
+    #include <linux/perf_event.h>
+    #include <sys/ioctl.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+
+    // Members of a group follow the leader, only the leader starts disabled
+    int perf_counters_impl_open(uint32_t type, uint64_t config, int group_fd) {
+        struct perf_event_attr attr = {0};
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = group_fd < 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+    }
+
+    // The first counter that opened leads the group
+    int perf_counters_impl_leader(PerfCounters* counters) {
+        for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+            if (counters->available[i]) return counters->fds[i];
+        }
+        return -1;
+    }
+
+    bool perf_counters_open(PerfCounters* counters) {
+        const uint32_t types[PERF_COUNTER_COUNT] = {
+            [PERF_COUNTER_CYCLES] = PERF_TYPE_HARDWARE,
+            [PERF_COUNTER_INSTRUCTIONS] = PERF_TYPE_HARDWARE,
+            [PERF_COUNTER_BRANCH_MISSES] = PERF_TYPE_HARDWARE,
+            [PERF_COUNTER_L1D_MISSES] = PERF_TYPE_HW_CACHE,
+            [PERF_COUNTER_LLC_MISSES] = PERF_TYPE_HW_CACHE,
+        };
+        const uint64_t configs[PERF_COUNTER_COUNT] = {
+            [PERF_COUNTER_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+            [PERF_COUNTER_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+            [PERF_COUNTER_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+            [PERF_COUNTER_L1D_MISSES] = PERF_COUNT_HW_CACHE_L1D
+                | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            [PERF_COUNTER_LLC_MISSES] = PERF_COUNT_HW_CACHE_LL
+                | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        };
+        *counters = (PerfCounters){0};
+        int leader = -1;
+        for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+            counters->fds[i] = perf_counters_impl_open(types[i], configs[i], leader);
+            counters->available[i] = counters->fds[i] >= 0;
+            if (counters->available[i] && leader < 0) leader = counters->fds[i];
+        }
+        return leader >= 0;
+    }
+
+    void perf_counters_start(PerfCounters* counters) {
+        int leader = perf_counters_impl_leader(counters);
+        if (leader < 0) return;
+        ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    void perf_counters_stop(PerfCounters* counters) {
+        int leader = perf_counters_impl_leader(counters);
+        if (leader < 0) return;
+        ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        // Counter count, time enabled, time running, then the values in the
+        // order the counters joined the group
+        uint64_t data[3 + PERF_COUNTER_COUNT] = {0};
+        ssize_t size = read(leader, data, sizeof(data));
+        if (size < (ssize_t)(3*sizeof(uint64_t)) || size != (ssize_t)((3 + data[0])*sizeof(uint64_t))) return;
+        // The group never got on the PMU, for example with more counters than it has
+        if (data[2] == 0) return;
+        size_t member = 0;
+        for (size_t i = 0; i < PERF_COUNTER_COUNT && member < data[0]; i++) {
+            if (!counters->available[i]) continue;
+            uint64_t value = data[3 + member++];
+            // Scale up when the kernel multiplexed the group
+            if (data[2] < data[1]) {
+                value = (uint64_t)((double)value * data[1] / data[2]);
+            }
+            counters->values[i] += value;
+        }
+    }
+
+    void perf_counters_close(PerfCounters* counters) {
+        for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+            if (counters->available[i]) close(counters->fds[i]);
+            counters->available[i] = false;
+        }
+    }
+#else
+    bool perf_counters_open(PerfCounters* counters) {
+        *counters = (PerfCounters){0};
+        return false;
+    }
+
+    void perf_counters_start(PerfCounters* counters) {
+        (void)counters;
+    }
+
+    void perf_counters_stop(PerfCounters* counters) {
+        (void)counters;
+    }
+
+    void perf_counters_close(PerfCounters* counters) {
+        (void)counters;
+    }
+#endif // __linux__
+
+void perf_counters_clear(PerfCounters* counters) {
+    for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+        counters->values[i] = 0;
+    }
+}
+
+#endif // PERF_COUNTERS_IMPLEMENTATION
@@ -0,0 +1,464 @@
+#define _CRT_SECURE_NO_WARNINGS (1)
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#define ARENA_IMPLEMENTATION
+#define ARENA_BACKEND_MALLOC
+#include "arena.h"
+#include <stdint.h>
+#define BITWRITER_IMPLEMENTATION
+#include "bit_writer.h"
+#define BITREADER_IMPLEMENTATION
+#include "bit_reader.h"
+#define HUFFMAN_IMPLEMENTATION
+#include "huffman.h"
+
+// Round trips through the paths the benchmark does not take. Prints every
+// failed check and exits with the number of failures.
+
+int test_failures = 0;
+
+#define TEST_CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        test_failures += 1; \
+    } \
+} while (0)
+
+// Same sequence on every platform, unlike rand()
+uint32_t test_random(uint64_t* state) {
+    *state = *state * 6364136223846793005ull + 1442695040888963407ull;
+    return (uint32_t)(*state >> 33);
+}
+
+// percent of the bytes are 'a', the others uniform
+char* test_skewed(Arena* arena, size_t len, uint32_t percent, uint64_t seed) {
+    char* msg = arena_new(arena, char, len + 1);
+    for (size_t i = 0; i < len; i++) {
+        msg[i] = test_random(&seed) % 100 < percent ? 'a' : (char)test_random(&seed);
+    }
+    return msg;
+}
+
+unsigned char* test_compress(Arena* arena, const char* msg, size_t len, int level, size_t symbol_size, size_t* out_len) {
+    HuffmanEncoder encoder = {0};
+    if (!huffman_encoder_init(&encoder, 1<<26, level)) return 0;
+    size_t capacity = huffman_compress_bound(len);
+    unsigned char* out = arena_new(arena, unsigned char, capacity);
+    bool ok = huffman_encoder_set_symbol_size(&encoder, symbol_size)
+        && huffman_encoder_compress(&encoder, msg, len, out, capacity, out_len);
+    huffman_encoder_deinit(&encoder);
+    return ok ? out : 0;
+}
+
+bool test_decompress_equal(HuffmanDecoder* decoder, Arena arena, const unsigned char* in, size_t in_len, const char* msg, size_t len) {
+    char* out = arena_new(&arena, char, len + 1);
+    size_t out_len = 0;
+    return huffman_decoder_decompress(decoder, in, in_len, out, len + 1, &out_len)
+        && out_len == len && memcmp(out, msg, len) == 0;
+}
+
+// Tables sampled at level 1 overestimate the payload of skewed blocks, which
+// once placed parallel chunks past the end of the input
+void test_parallel_skewed(Arena arena) {
+    size_t len = 3000000;
+    char* msg = test_skewed(&arena, len, 95, 1);
+    for (int level = 1; level <= 6; level += 5) {
+        size_t z_len = 0;
+        unsigned char* z = test_compress(&arena, msg, len, level, 1, &z_len);
+        TEST_CHECK(z);
+        if (!z) continue;
+        for (size_t threads = 1; threads <= 8; threads++) {
+            HuffmanDecoder decoder = {0};
+            TEST_CHECK(huffman_decoder_init(&decoder, 1<<24));
+            huffman_decoder_set_threads(&decoder, threads);
+            TEST_CHECK(test_decompress_equal(&decoder, arena, z, z_len, msg, len));
+            huffman_decoder_deinit(&decoder);
+        }
+    }
+}
+
+// Pushes msg and collects the output fragment bytes at a time
+unsigned char* test_push_compress(HuffmanEncoder* encoder, Arena* arena, const char* msg, size_t len, size_t fragment, size_t* out_len) {
+    size_t capacity = huffman_compress_bound(len);
+    unsigned char* out = arena_new(arena, unsigned char, capacity);
+    size_t offset = 0;
+    *out_len = 0;
+    while (true) {
+        size_t in_len = len - offset < fragment ? len - offset : fragment;
+        size_t out_capacity = capacity - *out_len < fragment ? capacity - *out_len : fragment;
+        size_t consumed = 0;
+        size_t written = 0;
+        HuffmanPushStatus status = huffman_encoder_push(encoder, msg + offset, in_len, offset + in_len == len, &consumed, out + *out_len, out_capacity, &written);
+        offset += consumed;
+        *out_len += written;
+        if (status == HUFFMAN_PUSH_DONE) return out;
+        if (status == HUFFMAN_PUSH_ERROR) return 0;
+    }
+}
+
+bool test_push_decompress_equal(HuffmanDecoder* decoder, Arena arena, const unsigned char* in, size_t in_len, size_t fragment, const char* msg, size_t len) {
+    char* out = arena_new(&arena, char, len + 1);
+    size_t offset = 0;
+    size_t out_len = 0;
+    while (true) {
+        size_t fragment_len = in_len - offset < fragment ? in_len - offset : fragment;
+        size_t out_capacity = len + 1 - out_len < fragment ? len + 1 - out_len : fragment;
+        size_t consumed = 0;
+        size_t written = 0;
+        HuffmanPushStatus status = huffman_decoder_push(decoder, in + offset, fragment_len, &consumed, out + out_len, out_capacity, &written);
+        offset += consumed;
+        out_len += written;
+        if (status == HUFFMAN_PUSH_DONE) break;
+        if (status == HUFFMAN_PUSH_ERROR) return false;
+        if (status == HUFFMAN_PUSH_NEED_INPUT && offset == in_len) return false;
+    }
+    return offset == in_len && out_len == len && memcmp(out, msg, len) == 0;
+}
+
+// One byte in and out at a time, both symbol sizes, on contexts that coded
+// whole messages before the first push
+void test_push(Arena arena) {
+    size_t len = 200000;
+    char* msg = test_skewed(&arena, len, 60, 3);
+    for (size_t symbol_size = 1; symbol_size <= 2; symbol_size++) {
+        HuffmanEncoder encoder = {0};
+        TEST_CHECK(huffman_encoder_init(&encoder, 1<<26, 6));
+        TEST_CHECK(huffman_encoder_set_symbol_size(&encoder, symbol_size));
+        size_t z_len = 0;
+        unsigned char* z = test_compress(&arena, msg, len, 6, symbol_size, &z_len);
+        TEST_CHECK(z);
+        size_t whole_len = 0;
+        TEST_CHECK(huffman_encoder_compress(&encoder, msg, len, z, huffman_compress_bound(len), &whole_len));
+
+        // An odd length leaves a trailing byte for wide symbols
+        size_t pushed_len = 0;
+        unsigned char* pushed = test_push_compress(&encoder, &arena, msg, len - 1, 1, &pushed_len);
+        TEST_CHECK(pushed);
+        huffman_encoder_deinit(&encoder);
+        if (!z || !pushed) continue;
+
+        HuffmanDecoder decoder = {0};
+        TEST_CHECK(huffman_decoder_init(&decoder, 1<<24));
+        TEST_CHECK(test_decompress_equal(&decoder, arena, z, whole_len, msg, len));
+        TEST_CHECK(test_push_decompress_equal(&decoder, arena, pushed, pushed_len, 1, msg, len - 1));
+        huffman_decoder_reset(&decoder);
+        TEST_CHECK(test_push_decompress_equal(&decoder, arena, z, whole_len, 7, msg, len));
+        huffman_decoder_deinit(&decoder);
+    }
+
+    // Scratch too small for the push buffers is an error, not an assertion
+    HuffmanEncoder encoder = {0};
+    TEST_CHECK(huffman_encoder_init(&encoder, 1<<18, 6));
+    size_t consumed = 0;
+    size_t written = 0;
+    unsigned char out[16];
+    TEST_CHECK(huffman_encoder_push(&encoder, msg, 16, true, &consumed, out, sizeof(out), &written) == HUFFMAN_PUSH_ERROR);
+    huffman_encoder_deinit(&encoder);
+    HuffmanDecoder decoder = {0};
+    TEST_CHECK(huffman_decoder_init(&decoder, 1<<16));
+    TEST_CHECK(huffman_decoder_push(&decoder, out, sizeof(out), &consumed, (char*)out, sizeof(out), &written) == HUFFMAN_PUSH_ERROR);
+    huffman_decoder_deinit(&decoder);
+}
+
+// Decoded results stay right while the cache grows past and shrinks below its
+// capacity, growing back within it takes no scratch
+void test_table_cache(Arena arena) {
+    enum { message_count = 3 };
+    size_t len = 100000;
+    char* msgs[message_count];
+    unsigned char* z[message_count];
+    size_t z_len[message_count];
+    for (size_t i = 0; i < message_count; i++) {
+        msgs[i] = test_skewed(&arena, len, 50 + 20*(uint32_t)i, 10 + i);
+        z[i] = test_compress(&arena, msgs[i], len, 4, 1, &z_len[i]);
+        TEST_CHECK(z[i]);
+        if (!z[i]) return;
+    }
+    HuffmanDecoder decoder = {0};
+    TEST_CHECK(huffman_decoder_init(&decoder, 1<<22));
+    size_t sizes[] = {1, 3, 2, 0, 3, 5, 1, 5};
+    size_t capacity = 0;
+    for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+        ptrdiff_t offset = decoder.scratch.offset;
+        TEST_CHECK(huffman_decoder_set_table_cache(&decoder, sizes[s]));
+        if (sizes[s] <= capacity) TEST_CHECK(decoder.scratch.offset == offset);
+        if (sizes[s] > capacity) capacity = sizes[s];
+        for (size_t round = 0; round < 2; round++) {
+            for (size_t i = 0; i < message_count; i++) {
+                TEST_CHECK(test_decompress_equal(&decoder, arena, z[i], z_len[i], msgs[i], len));
+            }
+        }
+        HuffmanTableCacheStats stats = huffman_decoder_table_cache_stats(&decoder);
+        if (sizes[s] >= message_count) TEST_CHECK(stats.hits > 0 && stats.evictions == 0);
+        if (sizes[s] == 0) TEST_CHECK(stats.hits + stats.misses == 0);
+    }
+    TEST_CHECK(!huffman_decoder_set_table_cache(&decoder, (size_t)1 << 20));
+    huffman_decoder_deinit(&decoder);
+}
+
+// 16-bit symbols, whole and streamed with the adaptive model, which the
+// histogram kernel and the model decay only touch through their symbol lists
+void test_wide(Arena arena) {
+    size_t len = 300001;
+    char* msg = arena_new(&arena, char, len);
+    uint64_t seed = 4;
+    for (size_t i = 0; i < len; i += 2) {
+        // Few distinct symbols for a while, then many
+        uint32_t symbol = i < len/2 ? 1000 + test_random(&seed) % 40 : test_random(&seed);
+        msg[i] = (char)symbol;
+        if (i + 1 < len) msg[i+1] = (char)(symbol >> 8);
+    }
+    HuffmanDecoder decoder = {0};
+    TEST_CHECK(huffman_decoder_init(&decoder, 1<<24));
+    for (int level = 1; level <= 9; level += 4) {
+        size_t z_len = 0;
+        unsigned char* z = test_compress(&arena, msg, len, level, 2, &z_len);
+        TEST_CHECK(z && test_decompress_equal(&decoder, arena, z, z_len, msg, len));
+    }
+
+    HuffmanEncoder encoder = {0};
+    TEST_CHECK(huffman_encoder_init(&encoder, 1<<26, 6));
+    TEST_CHECK(huffman_encoder_set_symbol_size(&encoder, 2));
+    size_t capacity = huffman_compress_bound(len);
+    BitWriterMemoryUserdata bits = {.data = arena_new(&arena, unsigned char, capacity), .capacity = capacity};
+    BitWriter writer = {.userdata = &bits, .write_bit = memory_write_bit, .flush = memory_flush};
+    for (size_t offset = 0; offset < len; offset += 7777) {
+        size_t chunk = len - offset < 7777 ? len - offset : 7777;
+        TEST_CHECK(huffman_encoder_stream_write(&encoder, writer, msg + offset, chunk));
+    }
+    TEST_CHECK(huffman_encoder_stream_end(&encoder, writer));
+    huffman_encoder_deinit(&encoder);
+    huffman_decoder_reset(&decoder);
+    TEST_CHECK(test_decompress_equal(&decoder, arena, bits.data, bits.len, msg, len));
+    huffman_decoder_reset(&decoder);
+    TEST_CHECK(test_push_decompress_equal(&decoder, arena, bits.data, bits.len, 3, msg, len));
+    huffman_decoder_deinit(&decoder);
+}
+
+// huffman_read borrows its scratch from the caller's arena and gives it back
+void test_read(Arena arena) {
+    size_t len = 500000;
+    char* msg = test_skewed(&arena, len, 70, 5);
+    for (size_t symbol_size = 1; symbol_size <= 2; symbol_size++) {
+        size_t z_len = 0;
+        unsigned char* z = test_compress(&arena, msg, len, 6, symbol_size, &z_len);
+        TEST_CHECK(z);
+        if (!z) continue;
+        Arena out_arena = arena_init(1<<24);
+        BitReaderMemoryUserdata bits = {.data = z, .len = z_len};
+        BitReader reader = {.userdata = &bits, .read_bit = memory_read_bit};
+        size_t out_len = 0;
+        bool ok = false;
+        char* out = huffman_read(&out_arena, reader, &out_len, &ok);
+        // 16-bit messages need more scratch than huffman_read takes
+        if (symbol_size == 1) TEST_CHECK(ok && out_len == len && memcmp(out, msg, len) == 0);
+        else TEST_CHECK(!ok);
+        TEST_CHECK(out_arena.reserved_length == 1<<24);
+        if (ok) TEST_CHECK((size_t)out_arena.offset < len + 64);
+        arena_deinit(&out_arena);
+    }
+}
+
+// Reads like a file, so the decoder cannot look at the input as a whole
+bool test_stream_read_bit(void* userdata, bool* bit) {
+    return memory_read_bit(userdata, bit);
+}
+
+// Frames of every kind concatenated byte-wise, as cat and compress --append
+// leave them, decode to the concatenation of their contents
+void test_concatenation(Arena arena) {
+    enum { frame_count = 5 };
+    size_t lens[frame_count] = {100000, 0, 70001, 1, 250000};
+    int levels[frame_count] = {1, 6, 9, 6, 6};
+    size_t symbol_sizes[frame_count] = {1, 1, 2, 1, 1};
+    size_t total = 0;
+    for (size_t i = 0; i < frame_count; i++) total += lens[i];
+    char* expected = test_skewed(&arena, total, 85, 6);
+    unsigned char* z = arena_new(&arena, unsigned char, huffman_compress_bound(total)*frame_count);
+    size_t z_len = 0;
+    size_t offset = 0;
+    for (size_t i = 0; i < frame_count; i++) {
+        size_t frame_len = 0;
+        unsigned char* frame = 0;
+        if (i == frame_count - 1) {
+            // The last frame is pushed, the others written whole
+            HuffmanEncoder encoder = {0};
+            TEST_CHECK(huffman_encoder_init(&encoder, 1<<26, levels[i]));
+            frame = test_push_compress(&encoder, &arena, expected + offset, lens[i], 4096, &frame_len);
+            huffman_encoder_deinit(&encoder);
+        }
+        else {
+            frame = test_compress(&arena, expected + offset, lens[i], levels[i], symbol_sizes[i], &frame_len);
+        }
+        TEST_CHECK(frame);
+        if (!frame) return;
+        memcpy(z + z_len, frame, frame_len);
+        z_len += frame_len;
+        offset += lens[i];
+    }
+
+    HuffmanDecoder decoder = {0};
+    TEST_CHECK(huffman_decoder_init(&decoder, 1<<24));
+    TEST_CHECK(test_decompress_equal(&decoder, arena, z, z_len, expected, total));
+    BitReaderMemoryUserdata bits = {.data = z, .len = z_len};
+    BitReader reader = {.userdata = &bits, .read_bit = test_stream_read_bit};
+    size_t out_len = 0;
+    bool ok = false;
+    char* out = huffman_decoder_read(&decoder, &arena, reader, &out_len, &ok);
+    TEST_CHECK(ok && out_len == total && memcmp(out, expected, total) == 0);
+
+    // The push decoder stops after each frame and leaves the rest unconsumed
+    size_t in_offset = 0;
+    offset = 0;
+    for (size_t i = 0; i < frame_count; i++) {
+        huffman_decoder_reset(&decoder);
+        char* frame_out = arena_new(&arena, char, lens[i] + 1);
+        size_t frame_out_len = 0;
+        HuffmanPushStatus status = HUFFMAN_PUSH_NEED_INPUT;
+        while (status == HUFFMAN_PUSH_NEED_INPUT || status == HUFFMAN_PUSH_NEED_OUTPUT) {
+            size_t fragment = z_len - in_offset < 1000 ? z_len - in_offset : 1000;
+            size_t consumed = 0;
+            size_t written = 0;
+            status = huffman_decoder_push(&decoder, z + in_offset, fragment, &consumed, frame_out + frame_out_len, lens[i] + 1 - frame_out_len, &written);
+            in_offset += consumed;
+            frame_out_len += written;
+            if (status == HUFFMAN_PUSH_NEED_INPUT && in_offset == z_len) break;
+        }
+        TEST_CHECK(status == HUFFMAN_PUSH_DONE && frame_out_len == lens[i] && memcmp(frame_out, expected + offset, lens[i]) == 0);
+        offset += lens[i];
+    }
+    TEST_CHECK(in_offset == z_len);
+    huffman_decoder_deinit(&decoder);
+}
+
+// Every variant the CPU runs writes the same bytes and decodes them, on one
+// thread and several, as if HUFFMAN_CPU had picked it
+void test_kernel_variants(Arena arena) {
+    huffman_kernels();
+    CpuVariant selected = huffman_kernels_variant;
+    CpuVariant best = cpu_detect_variant();
+    size_t len = 400001;
+    // Skewed enough for tANS, and not, for the Huffman kernels
+    uint32_t percents[] = {60, 92};
+    for (size_t case_index = 0; case_index < 2*2*2; case_index++) {
+        uint32_t percent = percents[case_index % 2];
+        size_t symbol_size = 1 + case_index / 2 % 2;
+        int level = case_index / 4 ? 6 : 1;
+        char* msg = test_skewed(&arena, len, percent, 7);
+        unsigned char* z[CPU_VARIANT_COUNT] = {0};
+        size_t z_len[CPU_VARIANT_COUNT] = {0};
+        for (size_t v = 0; v <= (size_t)best; v++) {
+            huffman_kernels_variant = (CpuVariant)v;
+            z[v] = test_compress(&arena, msg, len, level, symbol_size, &z_len[v]);
+            TEST_CHECK(z[v] && z_len[v] == z_len[0] && memcmp(z[v], z[0], z_len[0]) == 0);
+        }
+        for (size_t v = 0; z[0] && v <= (size_t)best; v++) {
+            huffman_kernels_variant = (CpuVariant)v;
+            for (size_t threads = 1; threads <= 4; threads += 3) {
+                HuffmanDecoder decoder = {0};
+                TEST_CHECK(huffman_decoder_init(&decoder, 1<<24));
+                huffman_decoder_set_threads(&decoder, threads);
+                TEST_CHECK(test_decompress_equal(&decoder, arena, z[0], z_len[0], msg, len));
+                huffman_decoder_deinit(&decoder);
+            }
+        }
+    }
+    huffman_kernels_variant = selected;
+}
+
+// Written by the first version, which had no frame header
+const unsigned char test_baseline_file[] = {
+    0x03, 0x0d, 0x20, 0x78, 0xb2, 0x95, 0x86, 0x81, 0x8e, 0x7b, 0x24, 0xe6,
+    0x57, 0x59, 0xe8, 0x9a, 0x21, 0xb6, 0x25, 0xbd, 0xc7, 0x2a, 0x17, 0x7a,
+    0x37, 0x9a, 0x40, 0x00, 0x00, 0x01, 0x93, 0xab, 0x30, 0xe0, 0x5e, 0x2e,
+    0x3a, 0xb3, 0x34, 0x40, 0xf2, 0x7f, 0x80,
+};
+const char test_baseline_msg[] = "hello world, hello legacy";
+
+// Writes msg in the format of the first version, see read_legacy_table.
+// Inverting the canonical codes keeps them a prefix code, but not a canonical one.
+unsigned char* test_legacy_compress(Arena* arena, const char* msg, size_t len, size_t* out_len) {
+    HuffmanHistogram histogram = {0};
+    HuffmanTable table = {0};
+    huffman_histogram_init(arena, &histogram, 256);
+    huffman_table_init(arena, &table, 256);
+    huffman_histogram((const unsigned char*)msg, len, 1, 1, &histogram);
+    huffman_table_from_histogram(*arena, &histogram, 24, &table);
+    size_t max_len = 0;
+    for (size_t i = 0; i < table.symbol_count; i++) {
+        if (table.entries[table.symbols[i]].len > max_len) max_len = table.entries[table.symbols[i]].len;
+    }
+    size_t nobfel = 1;
+    while (((size_t)1 << nobfel) <= max_len) nobfel++;
+    size_t capacity = len*4 + 4096;
+    BitWriterMemoryUserdata bits = {.data = arena_new(arena, unsigned char, capacity), .capacity = capacity};
+    BitWriter writer = {.userdata = &bits, .write_bit = memory_write_bit, .flush = memory_flush};
+    bool ok = write_byte(writer, (unsigned char)nobfel) && write_byte(writer, (unsigned char)table.symbol_count);
+    for (size_t i = 0; i < table.symbol_count; i++) {
+        HuffmanTableEntry entry = table.entries[table.symbols[i]];
+        ok = ok && write_byte(writer, (unsigned char)table.symbols[i])
+            && write_bits(writer, entry.len, nobfel)
+            && write_bits(writer, ~entry.code, entry.len);
+    }
+    ok = ok && write_encoded_message_length(writer, len);
+    for (size_t i = 0; i < len; i++) {
+        HuffmanTableEntry entry = table.entries[(unsigned char)msg[i]];
+        ok = ok && write_bits(writer, ~entry.code, entry.len);
+    }
+    ok = ok && write_byte(writer, 0xFF) && memory_flush(&bits);
+    *out_len = bits.len;
+    return ok ? bits.data : 0;
+}
+
+// Legacy frames, alone, concatenated with newer ones and on several threads
+void test_legacy(Arena arena) {
+    HuffmanDecoder decoder = {0};
+    TEST_CHECK(huffman_decoder_init(&decoder, 1<<24));
+    size_t msg_len = sizeof(test_baseline_msg) - 1;
+    TEST_CHECK(test_decompress_equal(&decoder, arena, test_baseline_file, sizeof(test_baseline_file), test_baseline_msg, msg_len));
+
+    // Skewed enough for codes longer than the lookup, which walk the tree
+    size_t len = 2000000;
+    char* msg = test_skewed(&arena, len, 90, 2);
+    size_t legacy_len = 0;
+    unsigned char* legacy = test_legacy_compress(&arena, msg, len, &legacy_len);
+    TEST_CHECK(legacy);
+    if (!legacy) return;
+    for (size_t threads = 1; threads <= 4; threads++) {
+        huffman_decoder_set_threads(&decoder, threads);
+        TEST_CHECK(test_decompress_equal(&decoder, arena, legacy, legacy_len, msg, len));
+    }
+
+    size_t z_len = 0;
+    unsigned char* z = test_compress(&arena, msg, len, 6, 1, &z_len);
+    TEST_CHECK(z);
+    if (!z) return;
+    size_t both_len = sizeof(test_baseline_file) + legacy_len + z_len;
+    unsigned char* both = arena_new(&arena, unsigned char, both_len);
+    memcpy(both, test_baseline_file, sizeof(test_baseline_file));
+    memcpy(both + sizeof(test_baseline_file), legacy, legacy_len);
+    memcpy(both + sizeof(test_baseline_file) + legacy_len, z, z_len);
+    char* expected = arena_new(&arena, char, msg_len + 2*len);
+    memcpy(expected, test_baseline_msg, msg_len);
+    memcpy(expected + msg_len, msg, len);
+    memcpy(expected + msg_len + len, msg, len);
+    TEST_CHECK(test_decompress_equal(&decoder, arena, both, both_len, expected, msg_len + 2*len));
+    huffman_decoder_deinit(&decoder);
+}
+
+int main(void) {
+    Arena arena = arena_init(1<<30);
+    printf("kernels: %s\n", huffman_kernels_name());
+    test_parallel_skewed(arena);
+    test_legacy(arena);
+    test_push(arena);
+    test_table_cache(arena);
+    test_wide(arena);
+    test_read(arena);
+    test_concatenation(arena);
+    test_kernel_variants(arena);
+    printf(test_failures ? "%d failed\n" : "all passed\n", test_failures);
+    arena_deinit(&arena);
+    return test_failures;
+}